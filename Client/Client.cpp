@@ -3,21 +3,47 @@
 
 #include <iostream>
 #include <chrono>
-#include <conio.h>
+#include <csignal>
 #include "logger.h"
 #include "client.h"
 
-constexpr uint16_t DEF_PORT = 64000;
-
-int main(){
+int main(int argc, char* argv[]){
     log_instance.init("client.log");
-    CLIENT.start("127.0.0.1", DEF_PORT);
-    while (true) {
-        if (_kbhit() && _getch() == VK_ESCAPE) {
-            CLIENT.stop();
-            break;
+    ept::endpoint_uri ep;
+    uint64_t bench_count{};
+    try {
+        std::string uri(cln::DEF_ENDPOINT);
+        const std::string bench_arg("--bench=");
+        for (int i = 1; i < argc; ++i) {
+            std::string arg(argv[i]);
+            if (arg.compare(0, bench_arg.size(), bench_arg) == 0) {
+                bench_count = std::stoull(arg.substr(bench_arg.size()));
+            }
+            else {
+                uri = arg;                          //tcp://host:port, unix:///path or shm://segment
+            }
         }
+        ep = ept::parse(uri);
+    }
+    catch (std::exception& e) {
+        log_write->error("bad arguments: {}", e.what());
+        return 1;
     }
+    CLIENT.start(ep, bench_count);
+    if (bench_count) {
+        CLIENT.wait();
+        return 0;
+    }
+    boost::asio::io_context signals_context;
+    boost::asio::signal_set signals(signals_context, SIGINT, SIGTERM);
+    signals.async_wait([](const boost::system::error_code& error, int signal_number) {
+        if (error) {
+            return;                                 //wait cancelled on shutdown
+        }
+        log_write->info("signal {} received, stopping client", signal_number);
+    });
+    signals_context.run();                          //blocks without spinning until SIGINT/SIGTERM
+    CLIENT.stop();
     return 0;
 }
 
@@ -6,6 +6,9 @@
 #include <boost/asio.hpp>
 #include "logger.h"
 #include "clnAlg.h"
+#include "endpoint.h"
+#include "shm_ring.h"
+#include "waiter.h"
 
 namespace cln {
 	using boost::asio::ip::tcp;
@@ -13,26 +16,27 @@ namespace cln {
 
 	constexpr uint8_t DEF_N_CLN = 10;
 	constexpr uint8_t MAX_ATTEMPTS = 3;
+	constexpr const char* DEF_ENDPOINT = "tcp://127.0.0.1:64000";
+	constexpr size_t UDP_BATCH = 64;
+	constexpr uint32_t UDP_QUERY_EVERY = 100;
 
 	class client {
 	public:
-		client(client&& cl) noexcept : thr_cln (std::move(cl.thr_cln)), ip_ (std::move(cl.ip_)), port_(cl.port_){}
-		client(const std::string& ip, const uint16_t& port): ip_(ip), port_(port){ }
+		client(client&& cl) noexcept : thr_cln (std::move(cl.thr_cln)), ep_ (std::move(cl.ep_)), bench_count(cl.bench_count){}
+		//bench_count > 0 sends that many numbers back to back, reports the time and ends
+		explicit client(const ept::endpoint_uri& ep, uint64_t bench_count_ = 0): ep_(ep), bench_count(bench_count_){ }
 		void start() {
 			thr_cln = std::thread(std::bind(&client::thr_func, this));
 		}
 		void stop() {
-			std::unique_lock<std::mutex> lck(mtx);
-			if (active != false) {
-				active = false;
-			}
-			else {
-				return;
+			active = false;
+			pacer.notify();
+			wait();
+		}
+		void wait() {
+			if (thr_cln.joinable()) {
+				thr_cln.join();
 			}
-			
-			lck.unlock();
-			cv.notify_one();
-			thr_cln.join();
 		}
 	private:
 		bool error_handler(boost::system::error_code &ec) {
@@ -41,25 +45,52 @@ namespace cln {
 			log_write->error("client error code:{} error message:{}", ec.value(), ec.message());
 			--attempts;
 			if (!attempts) {
-				std::lock_guard<std::mutex> lck(mtx);
 				return active = false;
 			}
 			return true;
 		}
 
 		void thr_func(){
-			log_write->info("client start");
+			log_write->info("client start endpoint:{}", ept::to_string(ep_));
 			active = true;
-			ip::tcp::socket sock(io_context);
-			ip::tcp::endpoint ep(ip::address::from_string(ip_), port_);
+			if (ep_.kind == ept::transport::SHM) {
+				exchange_shm();
+			}
+			else if (ep_.kind == ept::transport::UDP) {
+				exchange_udp(ip::udp::endpoint(ip::address::from_string(ep_.host), ep_.port));
+			}
+			else if (ep_.kind == ept::transport::UNIX) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+				exchange<local::stream_protocol>(local::stream_protocol::endpoint(ep_.path));
+#else
+				log_write->error("client unix domain sockets are not supported on this platform");
+#endif
+			}
+			else {
+				exchange<ip::tcp>(ip::tcp::endpoint(ip::address::from_string(ep_.host), ep_.port));
+			}
+			active = false;
+			log_write->info("client end");
+		}
+
+		//request/reply loop, the same for every stream transport
+		template<class Protocol>
+		void exchange(const typename Protocol::endpoint& ep) {
+			typename Protocol::socket sock(io_context);
 			boost::system::error_code ec;
 			sock.connect(ep,ec);
+			auto bench_start = std::chrono::steady_clock::now();
+			uint64_t replies{};
 			do {
 				if (ec) {
 					log_write->info("client connect error code:{} erro message:{}", ec.value(), ec.message());
 					break;
 				}
 				for (;;) {
+					if (bench_count && replies == bench_count) {
+						bench_report(replies, bench_start);
+						break;
+					}
 					uint32_t number_to_send = calg::random(0, 1023);
 					log_write->info("client send number:{}",  number_to_send);
 					size_t n_bytes_write = boost::asio::write(sock, boost::asio::buffer(&number_to_send, sizeof(number_to_send)),ec);
@@ -72,25 +103,152 @@ namespace cln {
 						break;
 					}
 					log_write->info("client read number:{}", number_from_read);
-					std::unique_lock<std::mutex> lck(mtx);
-					if (cv.wait_for(lck, std::chrono::milliseconds(1), [this] {return !active; })) {
+					++replies;
+					if (bench_count) {
+						continue;
+					}
+					if (pause_for(std::chrono::microseconds(1000))) {
 						log_write->info("client calling stop for thread end");
 						break;
 					}
-					lck.unlock();
 				}
 			} while (false);
-			active = false;
-			log_write->info("client end");
+		}
+
+		//request/reply loop over a slot of the server's shared memory segment, in bench mode
+		//requests are pipelined up to the ring size instead of waiting for every reply
+		void exchange_shm() {
+			std::unique_ptr<shm::mapping> map;
+			try {
+				map = shm::mapping::open(ep_.path);
+			}
+			catch (std::exception& e) {
+				log_write->info("client shared memory {} error message:{}", ep_.path, e.what());
+				return;
+			}
+			shm::slot* s = claim_slot(map->get());
+			if (s == nullptr) {
+				log_write->error("client no free slot in shared memory {}", ep_.path);
+				return;
+			}
+			auto bench_start = std::chrono::steady_clock::now();
+			uint64_t sent{}, replies{};
+			for (;;) {
+				if (bench_count) {
+					if (replies == bench_count) {
+						bench_report(replies, bench_start);
+						break;
+					}
+					while (sent < bench_count && s->requests.push(calg::random(0, 1023))) {
+						++sent;
+					}
+				}
+				else if (sent == replies) {
+					uint32_t number_to_send = calg::random(0, 1023);
+					log_write->info("client send number:{}", number_to_send);
+					s->requests.push(number_to_send);
+					++sent;
+				}
+				uint64_t number_from_read{};
+				while (s->replies.pop(number_from_read)) {
+					++replies;
+					if (!bench_count) {
+						log_write->info("client read number:{}", number_from_read);
+					}
+				}
+				auto pause = bench_count || sent != replies ? std::chrono::microseconds(0) : std::chrono::microseconds(1000);
+				if (pause_for(pause)) {
+					log_write->info("client calling stop for thread end");
+					break;
+				}
+				std::this_thread::yield();
+			}
+			s->state.store(shm::CLOSING, std::memory_order_release);
+		}
+
+		//fire and forget: batches of numbers behind a client id, the mean is asked for now and then
+		//with a datagram carrying only the id, in bench mode once after the last batch
+		void exchange_udp(const ip::udp::endpoint& ep) {
+			ip::udp::socket sock(io_context);
+			boost::system::error_code ec;
+			sock.open(ep.protocol(), ec);
+			if (ec) {
+				log_write->info("client udp open error code:{} erro message:{}", ec.value(), ec.message());
+				return;
+			}
+			uint32_t id = static_cast<uint32_t>(calg::random(1, INT32_MAX));
+			log_write->info("client udp id:{}", id);
+			auto bench_start = std::chrono::steady_clock::now();
+			uint64_t sent{};
+			uint32_t batches{};
+			uint32_t datagram[1 + UDP_BATCH];
+			datagram[0] = id;
+			for (;;) {
+				bool query = bench_count ? sent >= bench_count : ++batches % UDP_QUERY_EVERY == 0;
+				size_t count = query ? 0 : UDP_BATCH;
+				if (bench_count && !query) {
+					count = static_cast<size_t>(std::min<uint64_t>(UDP_BATCH, bench_count - sent));
+				}
+				for (size_t i = 0; i < count; ++i) {
+					datagram[1 + i] = calg::random(0, 1023);
+				}
+				sock.send_to(boost::asio::buffer(datagram, (1 + count) * sizeof(uint32_t)), ep, 0, ec);
+				if (!error_handler(ec)) {
+					break;
+				}
+				sent += count;
+				while (sock.available(ec) > 0) {
+					uint8_t reply[sizeof(uint32_t) + sizeof(uint64_t)];
+					ip::udp::endpoint from;
+					if (sock.receive_from(boost::asio::buffer(reply), from, 0, ec) == sizeof(reply)) {
+						uint64_t number_from_read{};
+						memcpy(&number_from_read, reply + sizeof(uint32_t), sizeof(number_from_read));
+						log_write->info("client read number:{}", number_from_read);
+						if (bench_count) {
+							bench_report(sent, bench_start);
+							return;
+						}
+					}
+				}
+				auto pause = bench_count && !query ? std::chrono::microseconds(0) : std::chrono::microseconds(1000);
+				if (pause_for(pause)) {
+					log_write->info("client calling stop for thread end");
+					break;
+				}
+			}
+		}
+
+		//paces the next request, true once stop() was called
+		bool pause_for(std::chrono::microseconds pause) {
+			if (pause.count()) {
+				pacer.wait_for(pause, [this] {return !active.load(); });
+			}
+			return !active.load();
+		}
+
+		shm::slot* claim_slot(shm::segment* seg) {
+			for (uint32_t i = 0; i < shm::MAX_SLOTS; ++i) {
+				uint32_t expected = shm::FREE;
+				if (seg->slots[i].state.compare_exchange_strong(expected, shm::CLAIMED, std::memory_order_acq_rel)) {
+					seg->slots[i].owner.store(shm::current_pid(), std::memory_order_release);	//the server frees the slot if this process dies
+					log_write->info("client shared memory slot {}", i);
+					return &seg->slots[i];
+				}
+			}
+			return nullptr;
+		}
+
+		void bench_report(uint64_t count, std::chrono::steady_clock::time_point start) {
+			auto took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+			log_write->info("client bench {} numbers over {} in {} us, {} ns per number", count, ept::to_string(ep_), took, count ? took * 1000 / count : 0);
 		}
 
 	private:
 		std::thread thr_cln;
-		std::string ip_{};
-		uint16_t port_{};
-		std::mutex mtx;
-		std::condition_variable cv;
-		bool active{ false };
+		ept::endpoint_uri ep_{};
+		uint64_t bench_count{};
+		wt::waiter pacer;
+		std::atomic_bool active{ false };
 		boost::asio::io_context io_context;
 	};
 
@@ -106,11 +264,14 @@ namespace cln {
 			static client_mgr cmgr;
 			return cmgr;
 		}
-		void start(const std::string& ip, const uint16_t& port) {
-			log_write->info("client manager start ip:{} port:{}", ip, port);
-			cln = std::make_unique<client>(std::forward<client>(client(ip, port)));
+		void start(const ept::endpoint_uri& ep, uint64_t bench_count = 0) {
+			log_write->info("client manager start endpoint:{}", ept::to_string(ep));
+			cln = std::make_unique<client>(std::forward<client>(client(ep, bench_count)));
 			cln->start();
 		}
+		void wait() {
+			cln->wait();
+		}
 		void stop() {
 			log_write->info("clients manager started waiting end");
 			cln->stop();
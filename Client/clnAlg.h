@@ -4,8 +4,7 @@
 namespace calg {
 
     int random(uint32_t min, uint32_t max) {
-        std::random_device rd;                              //Will be used to obtain a seed for the random number engine
-        static std::mt19937 gen(rd());                      //Standard mersenne_twister_engine seeded with rd()
+        static std::mt19937 gen(std::random_device{}());    //Standard mersenne_twister_engine seeded once from random_device
         std::uniform_int_distribution<> distrib(min, max);
         return distrib(gen);
     }
@@ -0,0 +1,153 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/detail/os_thread_functions.hpp>
+#ifndef _WIN32
+#include <signal.h>
+#include <cerrno>
+#endif
+
+namespace shm {
+
+    //layout shared by server and client, both sides must be built from the same copy of this file
+    constexpr uint32_t SEGMENT_MAGIC = 0x43534D32;
+    constexpr uint32_t MAX_SLOTS = 64;
+    constexpr uint32_t RING_SIZE = 1024;
+    constexpr size_t CACHE_LINE = 64;
+
+    static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared memory rings need lock free atomics");
+
+    //single producer single consumer ring, indexes run freely and are masked on access
+    template<class T, uint32_t N>
+    struct spsc_ring {
+        static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+        bool push(const T& v) {
+            uint32_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == N) {
+                return false;
+            }
+            cells[t & (N - 1)] = v;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& v) {
+            uint32_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+            v = cells[h & (N - 1)];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+        bool full() const {
+            return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire) == N;
+        }
+
+        void reset() {
+            head.store(0, std::memory_order_relaxed);
+            tail.store(0, std::memory_order_relaxed);
+        }
+
+        alignas(CACHE_LINE) std::atomic<uint32_t> head;     //written by the consumer
+        alignas(CACHE_LINE) std::atomic<uint32_t> tail;     //written by the producer
+        alignas(CACHE_LINE) T cells[N];
+    };
+
+    //client claims a free slot, server activates it, client closes it, server frees it after the last request
+    enum SLOT_STATE : uint32_t {
+        FREE = 0,
+        CLAIMED = 1,
+        ACTIVE = 2,
+        CLOSING = 3
+    };
+
+    struct slot {
+        alignas(CACHE_LINE) std::atomic<uint32_t> state;
+        std::atomic<uint32_t> owner;                        //pid of the claiming client, 0 until it is stored
+        spsc_ring<uint32_t, RING_SIZE> requests;
+        spsc_ring<uint64_t, RING_SIZE> replies;
+    };
+
+    struct segment {
+        uint32_t magic;
+        uint32_t slots_count;               //informational, both sides index the slots up to MAX_SLOTS
+        slot slots[MAX_SLOTS];
+    };
+
+    inline uint32_t current_pid() {
+        return static_cast<uint32_t>(boost::interprocess::ipcdetail::get_current_process_id());
+    }
+
+    //false only for a process known to be gone, an unknown owner counts as alive,
+    //on windows a slot is freed by its client alone
+    inline bool process_alive(uint32_t pid) {
+#ifndef _WIN32
+        return pid == 0 || ::kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH;
+#else
+        return true;
+#endif
+    }
+
+    //mapping of a named segment, the creator removes the name when it goes away
+    class mapping final {
+    public:
+        static std::unique_ptr<mapping> create(const std::string& name) {
+            using namespace boost::interprocess;
+            shared_memory_object::remove(name.c_str());
+            shared_memory_object obj(create_only, name.c_str(), read_write);
+            obj.truncate(sizeof(segment));
+            std::unique_ptr<mapping> m(new mapping(name, true, mapped_region(obj, read_write)));
+            segment* seg = new (m->region.get_address()) segment();
+            for (auto& s : seg->slots) {
+                s.state.store(FREE, std::memory_order_relaxed);
+                s.owner.store(0, std::memory_order_relaxed);
+                s.requests.reset();
+                s.replies.reset();
+            }
+            seg->slots_count = MAX_SLOTS;
+            std::atomic_thread_fence(std::memory_order_release);
+            seg->magic = SEGMENT_MAGIC;
+            return m;
+        }
+
+        static std::unique_ptr<mapping> open(const std::string& name) {
+            using namespace boost::interprocess;
+            shared_memory_object obj(open_only, name.c_str(), read_write);
+            std::unique_ptr<mapping> m(new mapping(name, false, mapped_region(obj, read_write)));
+            if (m->region.get_size() < sizeof(segment) || m->get()->magic != SEGMENT_MAGIC) {
+                throw std::runtime_error("shared memory segment " + name + " has an unknown layout");
+            }
+            return m;
+        }
+
+        ~mapping() {
+            if (owner) {
+                boost::interprocess::shared_memory_object::remove(name.c_str());
+            }
+        }
+
+        segment* get() {
+            return static_cast<segment*>(region.get_address());
+        }
+    private:
+        mapping(const std::string& name_, bool owner_, boost::interprocess::mapped_region&& region_)
+            : name(name_), owner(owner_), region(std::move(region_)) {}
+
+        std::string name;
+        bool owner;
+        boost::interprocess::mapped_region region;
+    };
+}
@@ -4,8 +4,18 @@
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
 #include "connect.h"
+#include "agg.h"
+#include "window.h"
+#include "order.h"
+#include "histogram.h"
+#include "global_stats.h"
+#include "topk.h"
 #include <unordered_set>
+#include <list>
+#include <utility>
 #include <numeric>
+#include <memory>
+#include <span>
 
 #include <fstream>
 namespace salg {
@@ -18,12 +28,14 @@ namespace salg {
         void push(const T& t) {
             const std::lock_guard<std::mutex> lock_mutex(mtx);
             wq->emplace(t);
+            count.fetch_add(1, std::memory_order_relaxed);
         }
         bool pop(T& t) {
             auto _pop = [&]()->bool {
                 if (!rq->empty()) {
                     t = std::move(rq->front());
                     rq->pop();
+                    count.fetch_sub(1, std::memory_order_relaxed);
                     return true;
                 }
                 return false;
@@ -40,42 +52,588 @@ namespace salg {
                 return _pop();
             }
         }
+        size_t size() const {
+            return count.load(std::memory_order_relaxed);
+        }
     private:
         std::queue<T> write_q;
         std::queue<T> read_q;
         std::queue<T>* rq{ &read_q };
         std::queue<T>* wq{ &write_q };
         std::mutex mtx;
+        std::atomic<size_t> count{ 0 };
     };
 
+    constexpr size_t ENTRY_OVERHEAD = 128;          //map node, set header and arena bookkeeping of one connection
+    constexpr uint64_t APPROX_IMAGE = 1ULL << 63;   //value count flag of a connection serialized as a sketch
+    constexpr uint64_t HISTOGRAM_IMAGE = 1ULL << 62;    //value count flag of a connection whose histogram follows its values
+    constexpr size_t INSERT_BATCH = 64;             //numbers a batch insert transforms at a time
+
+    //numbers of every connection, open ones stay until they close, closed ones are kept in a bounded
+    //lru for a resume and evicted when the lru is full or memory is over the budget, 0 means no limit,
+    //what is kept of the numbers comes from the agg policies: Transform maps each number to the stored value,
+    //Uniqueness picks the store and Stats are the aggregations, the first of them is the reply
+    template<class Transform, class Uniqueness, class... Stats>
     class storage_numbers final {
+        using store_type = typename Uniqueness::store;
+        static_assert(std::is_trivially_copyable<agg::accumulator<Stats...>>::value, "aggregation states are copied into hot restart images");
+
+        //the running aggregations keep every query O(1) however large the set grows, values live in the
+        //connection's own arena so inserts don't allocate and retiring a connection frees its slabs at once,
+        //past the approximation threshold the store is replaced by a fixed size sketch and the arena is released
+        struct numbers_set {
+            numbers_set() : values(arena) {}
+            mem::arena arena;
+            store_type values;
+            agg::accumulator<Stats...> stats;
+            std::unique_ptr<skt::distinct_sketch> approx;
+            std::unique_ptr<wnd::sliding_window> window;
+            std::unique_ptr<ord::order_index> order;
+            std::unique_ptr<hst::value_histogram> histogram;
+            bool closed{ false };
+            std::list<uint32_t>::iterator lru_pos;
+        };
     public:
+        void set_retention(size_t retain_closed_, size_t budget_bytes_) {
+            retain_closed = retain_closed_;
+            budget_bytes = budget_bytes_;
+        }
+
+        //connections with more distinct values than threshold switch to the approximate mode, 0 keeps every set exact
+        void set_approximation(size_t threshold) {
+            approx_threshold = threshold;
+        }
+
+        //recent values are kept in a sliding window too, replies then carry its mean,
+        //windows start empty after a hot restart and fill within one span
+        void set_window(const wnd::config& cfg) {
+            window_cfg = cfg;
+        }
+
+        //stored values are indexed for rank and quantile queries, a sketched connection answers from its sample
+        void set_order_stats(bool enabled) {
+            order_stats = enabled;
+        }
+
+        //every number a connection sends is counted into the bins of l, repeats included
+        void set_histograms(bool enabled, const hst::layout& l) {
+            histograms = enabled;
+            hist_layout = l;
+        }
+
+        //every received value is added to the thread's partial of the global aggregates
+        void set_global(std::shared_ptr<gst::partial> partial) {
+            global = std::move(partial);
+        }
+
+        const hst::layout& histogram_layout() const {
+            return hist_layout;
+        }
+
+        //numbers for a retained connection bring it back
         void to_storage(uint32_t number_connection, uint32_t number) {
-            storage[number_connection].insert(number*number);
+            auto& nums = resume(number_connection);
+            uint64_t v = Transform::apply(number);
+            if (global) {
+                global->observe(v);
+            }
+            top_messages.add(number_connection);
+            size_t stored = nums.values.size();
+            bool grew = insert(nums, v);
+            if (nums.values.size() > stored) {
+                top_values.add(number_connection);      //a sketched connection's growth is not counted
+            }
+            if (histograms) {
+                grew = add_to_histogram(nums, number) || grew;
+            }
+            if (window_cfg) {
+                grew = add_to_window(nums, v) || grew;
+            }
+            if (grew && budget_bytes && memory() > budget_bytes) {
+                evict();
+            }
+        }
+
+        //count numbers of one connection at once, the path of frames carrying many: every INSERT_BATCH of them
+        //is transformed in one pass, the global sum takes them in one update and the store prefetches their
+        //slots before probing, returns how many values the exact store did not have, 0 for a sketched connection
+        size_t to_storage(uint32_t number_connection, std::span<const uint32_t> numbers) {
+            auto& nums = resume(number_connection);
+            size_t count = numbers.size();
+            top_messages.add(number_connection, count);
+            uint64_t values[INSERT_BATCH];
+            size_t fresh{ 0 };
+            bool grew{ false };
+            for (size_t done = 0; done < count;) {
+                size_t batch = std::min(count - done, INSERT_BATCH);
+                Transform::apply(numbers.data() + done, batch, values);
+                if (global) {
+                    global->observe(values, batch);
+                }
+                size_t stored = nums.values.size();
+                grew = insert(nums, values, batch, fresh) || grew;
+                if (nums.values.size() > stored) {
+                    top_values.add(number_connection, nums.values.size() - stored);
+                }
+                if (window_cfg) {
+                    grew = add_to_window(nums, values, batch) || grew;
+                }
+                done += batch;
+            }
+            if (histograms) {
+                grew = add_to_histogram(nums, numbers.data(), count) || grew;
+            }
+            if (grew && budget_bytes && memory() > budget_bytes) {
+                evict();
+            }
+            return fresh;
+        }
+
+        //the connection is gone, its state moves to the front of the lru
+        void close(uint32_t number_connection) {
+            auto it = storage.find(number_connection);
+            if (it == std::end(storage) || it->second.closed) {
+                return;
+            }
+            it->second.closed = true;
+            closed_lru.push_front(number_connection);
+            it->second.lru_pos = closed_lru.begin();
+            evict();
+        }
+
+        //bytes held for one connection, 0 if nothing is stored for it
+        size_t memory(uint32_t number_connection) const {
+            auto it = storage.find(number_connection);
+            if (it == std::end(storage)) {
+                return 0;
+            }
+            return it->second.arena.reserved() + (it->second.approx ? sizeof(skt::distinct_sketch) : 0) +
+                (it->second.window ? it->second.window->memory() : 0) + (it->second.order ? it->second.order->memory() : 0) +
+                (it->second.histogram ? it->second.histogram->memory() : 0) + ENTRY_OVERHEAD;
+        }
+
+        size_t memory() const {
+            return arena_bytes + approx_count * sizeof(skt::distinct_sketch) + window_bytes + order_bytes + histogram_bytes + storage.size() * ENTRY_OVERHEAD;
+        }
+
+        size_t approximated() const {
+            return approx_count;
+        }
+
+        size_t retained() const {
+            return closed_lru.size();
+        }
+
+        //connections sending the most numbers and storing the most values, largest first
+        void heavy_hitters(std::vector<tpk::entry>& messages, std::vector<tpk::entry>& values) const {
+            top_messages.top(tpk::REPORTED, messages);
+            top_values.top(tpk::REPORTED, values);
+        }
+
+        //evictions and resumes since the last call
+        size_t take_evicted() {
+            return std::exchange(evicted_count, 0);
+        }
+
+        size_t take_resumed() {
+            return std::exchange(resumed_count, 0);
         }
         
-        bool get_arithmetic_mean(uint32_t number_connection, uint64_t& arithmetic_mean) {
+        //the first aggregation or the window mean, what a reply carries
+        bool get_result(uint32_t number_connection, uint64_t& result) {
             auto it = storage.find(number_connection);
             if (it != std::end(storage)) {
-                arithmetic_mean =  (std::accumulate(std::begin(it->second), std::end(it->second), 0) / it->second.size());
+                result = it->second.window ? it->second.window->mean(wnd::now_ms()) : it->second.stats.result(estimates(it->second));
+                return true;
+            }
+            return false;
+        }
+
+        //every aggregation as "name:value" pairs
+        bool describe(uint32_t number_connection, std::string& out) {
+            auto it = storage.find(number_connection);
+            if (it != std::end(storage)) {
+                out = it->second.stats.describe(estimates(it->second));
+                if (it->second.order || it->second.approx) {
+                    for (double q : { 0.5, 0.9, 0.99 }) {
+                        uint64_t v{};
+                        quantile(number_connection, q, v);
+                        out += " p" + std::to_string(static_cast<int>(q * 100)) + ":" + std::to_string(v);
+                    }
+                }
+                if (it->second.window) {
+                    uint64_t now = wnd::now_ms();
+                    out += " window_mean:" + std::to_string(it->second.window->mean(now)) + " window_count:" + std::to_string(it->second.window->count(now));
+                }
                 return true;
             }
             return false;
         }
         
-        bool get_storage(const uint32_t number_connection, std::unordered_set<uint64_t>& nums) {
+        //nearest rank quantile of the stored values, q in [0, 1]
+        bool quantile(uint32_t number_connection, double q, uint64_t& out) {
+            auto it = storage.find(number_connection);
+            if (it == std::end(storage) || !(it->second.order || it->second.approx)) {
+                return false;
+            }
+            out = it->second.approx ? it->second.approx->quantile(q) : it->second.order->quantile(q);
+            return true;
+        }
+
+        //stored values below the transformed number
+        bool rank(uint32_t number_connection, uint32_t number, uint64_t& out) {
+            auto it = storage.find(number_connection);
+            if (it == std::end(storage) || !(it->second.order || it->second.approx)) {
+                return false;
+            }
+            uint64_t v = Transform::apply(number);
+            out = it->second.approx ? it->second.approx->rank(v) : it->second.order->rank(v);
+            return true;
+        }
+
+        //one count per bin of histogram_layout()
+        bool get_histogram(uint32_t number_connection, std::vector<uint64_t>& counts) {
+            auto it = storage.find(number_connection);
+            if (it == std::end(storage) || !it->second.histogram) {
+                return false;
+            }
+            it->second.histogram->snapshot(counts);
+            return true;
+        }
+
+        //an approximated connection gives its sample of distinct values
+        bool get_storage(const uint32_t number_connection, std::vector<uint64_t>& nums) {
             auto it = storage.find(number_connection);
             if (it != std::end(storage)) {
-                nums = it->second;
+                if (it->second.approx) {
+                    it->second.approx->sample_values(nums);
+                }
+                else {
+                    it->second.values.copy_to(nums);
+                }
                 return true;
             }
             return false;
         }
 
+        template<class F>
+        void for_each_number(F&& f) {
+            for (auto& entry : storage) {
+                f(entry.first);
+            }
+        }
+
+        //drops everything stored for a connection, its arena goes back in one piece
+        bool retire(uint32_t number_connection) {
+            auto it = storage.find(number_connection);
+            if (it == std::end(storage)) {
+                return false;
+            }
+            if (it->second.closed) {
+                closed_lru.erase(it->second.lru_pos);
+            }
+            values_count -= it->second.values.size();
+            arena_bytes -= it->second.arena.reserved();
+            if (it->second.approx) {
+                --approx_count;
+            }
+            if (it->second.window) {
+                window_bytes -= it->second.window->memory();
+            }
+            if (it->second.order) {
+                order_bytes -= it->second.order->memory();
+            }
+            if (it->second.histogram) {
+                histogram_bytes -= it->second.histogram->memory();
+            }
+            storage.erase(it);
+            return true;
+        }
+
+        size_t size() const {
+            return storage.size();
+        }
+
+        size_t values() const {
+            return values_count;
+        }
+
+        size_t reserved_bytes() const {
+            return arena_bytes;
+        }
+
+        //flat image used by hot restart: per connection its number, value count and values,
+        //or APPROX_IMAGE, the sketch image and the aggregation states for an approximated one,
+        //with HISTOGRAM_IMAGE set the bin count and the counts come last
+        void serialize(std::vector<uint8_t>& out) {
+            auto put = [&out](const void* p, size_t sz) {
+                out.insert(out.end(), static_cast<const uint8_t*>(p), static_cast<const uint8_t*>(p) + sz);
+            };
+            for (auto& entry : storage) {
+                uint64_t count = (entry.second.approx ? APPROX_IMAGE : entry.second.values.size()) | (entry.second.histogram ? HISTOGRAM_IMAGE : 0);
+                put(&entry.first, sizeof(entry.first));
+                put(&count, sizeof(count));
+                if (entry.second.approx) {
+                    entry.second.approx->serialize(out);
+                    put(&entry.second.stats, sizeof(entry.second.stats));
+                }
+                else {
+                    entry.second.values.for_each([&put](uint64_t v) {
+                        put(&v, sizeof(v));
+                    });
+                }
+                if (entry.second.histogram) {
+                    std::vector<uint64_t> counts;
+                    entry.second.histogram->snapshot(counts);
+                    uint32_t bins = static_cast<uint32_t>(counts.size());
+                    put(&bins, sizeof(bins));
+                    put(counts.data(), counts.size() * sizeof(uint64_t));
+                }
+            }
+        }
+
+        bool deserialize(const std::vector<uint8_t>& in) {
+            size_t pos{ 0 };
+            auto get = [&in, &pos](void* p, size_t sz) {
+                if (in.size() - pos < sz) {
+                    return false;
+                }
+                memcpy(p, in.data() + pos, sz);
+                pos += sz;
+                return true;
+            };
+            while (pos < in.size()) {
+                uint32_t number_connection{};
+                uint64_t count{};
+                if (!get(&number_connection, sizeof(number_connection)) || !get(&count, sizeof(count))) {
+                    return false;
+                }
+                auto& nums = storage[number_connection];
+                bool with_histogram = (count & HISTOGRAM_IMAGE) != 0;
+                count &= ~HISTOGRAM_IMAGE;
+                if (count == APPROX_IMAGE) {
+                    if (in.size() - pos < skt::distinct_sketch::image_size() || nums.approx) {
+                        return false;
+                    }
+                    nums.approx = std::make_unique<skt::distinct_sketch>();
+                    ++approx_count;
+                    if (!nums.approx->deserialize(in.data() + pos)) {
+                        return false;
+                    }
+                    pos += skt::distinct_sketch::image_size();
+                    if (!get(&nums.stats, sizeof(nums.stats))) {
+                        return false;
+                    }
+                }
+                else {
+                    for (uint64_t i = 0; i < count; ++i) {
+                        uint64_t v{};
+                        if (!get(&v, sizeof(v))) {
+                            return false;
+                        }
+                        insert(nums, v);
+                    }
+                }
+                if (with_histogram) {
+                    uint32_t bins{};
+                    if (!get(&bins, sizeof(bins))) {
+                        return false;
+                    }
+                    std::vector<uint64_t> counts(bins);
+                    if (!get(counts.data(), counts.size() * sizeof(uint64_t))) {
+                        return false;
+                    }
+                    if (histograms && bins == hist_layout.bins()) {         //counts binned by another layout are dropped
+                        add_to_histogram(nums, nullptr, 0);
+                        nums.histogram->load(counts);
+                    }
+                }
+            }
+            return true;
+        }
+
     private:
-        std::unordered_map<uint32_t, std::unordered_set<uint64_t> > storage;
-    };
+        numbers_set& resume(uint32_t number_connection) {
+            auto& nums = storage[number_connection];
+            if (nums.closed) {
+                closed_lru.erase(nums.lru_pos);
+                nums.closed = false;
+                ++resumed_count;
+            }
+            return nums;
+        }
 
+        //true when the value was new and took more memory
+        bool insert(numbers_set& nums, uint64_t v) {
+            if (nums.approx) {
+                nums.approx->insert(v);
+                if (Uniqueness::unique) {
+                    nums.stats.add_repeat(v);       //the sketch can't tell a new value from a repeat
+                }
+                else {
+                    nums.stats.add(v);
+                }
+                return false;
+            }
+            size_t reserved = nums.arena.reserved();
+            if (nums.values.insert(v)) {
+                nums.stats.add(v);
+                ++values_count;
+                arena_bytes += nums.arena.reserved() - reserved;
+                if (approx_threshold && nums.values.size() > approx_threshold) {
+                    approximate(nums);
+                    return false;
+                }
+                bool grew = nums.arena.reserved() != reserved;
+                if (order_stats) {
+                    grew = add_to_order(nums, v) || grew;
+                }
+                return grew;
+            }
+            return false;
+        }
 
+        //true when new values took more memory, fresh grows by the number of new values
+        bool insert(numbers_set& nums, const uint64_t* v, size_t n, size_t& fresh) {
+            if (nums.approx) {
+                for (size_t i = 0; i < n; ++i) {
+                    insert(nums, v[i]);
+                }
+                return false;
+            }
+            size_t reserved = nums.arena.reserved();
+            bool order_grew{ false };
+            size_t added = nums.values.insert(v, n, [this, &nums, &order_grew](uint64_t x) {
+                nums.stats.add(x);
+                if (order_stats) {
+                    order_grew = add_to_order(nums, x) || order_grew;
+                }
+            });
+            values_count += added;
+            fresh += added;
+            arena_bytes += nums.arena.reserved() - reserved;
+            if (approx_threshold && nums.values.size() > approx_threshold) {
+                approximate(nums);
+                return false;
+            }
+            return nums.arena.reserved() != reserved || order_grew;
+        }
+
+        //true when the histogram was created
+        bool add_to_histogram(numbers_set& nums, const uint32_t* numbers, size_t count) {
+            bool created = !nums.histogram;
+            if (created) {
+                nums.histogram = std::make_unique<hst::value_histogram>(hist_layout);
+                histogram_bytes += nums.histogram->memory();
+            }
+            if (count == 1) {
+                nums.histogram->add(*numbers);
+            }
+            else if (count) {
+                nums.histogram->add(numbers, count);
+            }
+            return created;
+        }
+
+        bool add_to_histogram(numbers_set& nums, uint32_t number) {
+            return add_to_histogram(nums, &number, 1);
+        }
+
+        //true when the index took more memory
+        bool add_to_order(numbers_set& nums, uint64_t v) {
+            if (!nums.order) {
+                nums.order = std::make_unique<ord::order_index>();
+            }
+            size_t before = nums.order->memory();
+            nums.order->insert(v);
+            size_t after = nums.order->memory();
+            order_bytes = order_bytes + after - before;
+            return after > before;
+        }
+
+        //true when the window took more memory, a batch arrives at one moment
+        bool add_to_window(numbers_set& nums, const uint64_t* values, size_t count) {
+            bool created = !nums.window;
+            if (created) {
+                nums.window = std::make_unique<wnd::sliding_window>(window_cfg, Uniqueness::unique);
+                window_bytes += nums.window->memory();
+            }
+            size_t before = nums.window->memory();
+            uint64_t now = wnd::now_ms();
+            for (size_t i = 0; i < count; ++i) {
+                nums.window->add(values[i], now);
+            }
+            size_t after = nums.window->memory();
+            window_bytes = window_bytes + after - before;       //a pruned window gives memory back
+            return created || after > before;
+        }
+
+        bool add_to_window(numbers_set& nums, uint64_t v) {
+            return add_to_window(nums, &v, 1);
+        }
+
+        //a distinct connection's sketch answers the non idempotent aggregations, the others stay exact
+        static const skt::distinct_sketch* estimates(const numbers_set& nums) {
+            return Uniqueness::unique ? nums.approx.get() : nullptr;
+        }
+
+        //the exact store is folded into a sketch and its arena is given back,
+        //only the sample of the sketch is dumped from then on
+        void approximate(numbers_set& nums) {
+            nums.approx = std::make_unique<skt::distinct_sketch>();
+            nums.values.for_each([&nums](uint64_t v) {
+                nums.approx->insert(v);
+            });
+            values_count -= nums.values.size();
+            arena_bytes -= nums.arena.reserved();
+            if (nums.order) {
+                order_bytes -= nums.order->memory();
+                nums.order.reset();
+            }
+            nums.values.clear();
+            nums.arena.release();
+            ++approx_count;
+        }
+
+        //oldest closed connections go first, open ones are never evicted
+        void evict() {
+            while (!closed_lru.empty() && ((retain_closed && closed_lru.size() > retain_closed) || (budget_bytes && memory() > budget_bytes))) {
+                retire(closed_lru.back());
+                ++evicted_count;
+            }
+            bool over = budget_bytes && memory() > budget_bytes;
+            if (over && !over_budget) {
+                log_write->warn("storage_numbers: open connections hold {} bytes, over the budget of {} bytes", memory(), budget_bytes);
+            }
+            over_budget = over;
+        }
+
+        std::unordered_map<uint32_t, numbers_set> storage;
+        std::list<uint32_t> closed_lru;             //most recently closed first
+        size_t values_count{ 0 };
+        size_t arena_bytes{ 0 };
+        size_t approx_count{ 0 };
+        size_t approx_threshold{ 0 };
+        wnd::config window_cfg;
+        size_t window_bytes{ 0 };
+        bool order_stats{ false };
+        size_t order_bytes{ 0 };
+        bool histograms{ false };
+        hst::layout hist_layout;
+        size_t histogram_bytes{ 0 };
+        std::shared_ptr<gst::partial> global;
+        tpk::space_saving top_messages;
+        tpk::space_saving top_values;
+        size_t retain_closed{ 0 };
+        size_t budget_bytes{ 0 };
+        size_t evicted_count{ 0 };
+        size_t resumed_count{ 0 };
+        bool over_budget{ false };
+    };
 
+    //aggregation a build keeps, a product line picks its own with -DSRV_AGGREGATION="agg::identity, agg::all, agg::max"
+#ifndef SRV_AGGREGATION
+#define SRV_AGGREGATION agg::square, agg::distinct, agg::mean
+#endif
+    using storage_type = storage_numbers<SRV_AGGREGATION>;
 }
\ No newline at end of file
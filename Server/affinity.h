@@ -0,0 +1,72 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "logger.h"
+
+namespace aff {
+
+    //ids of the cpus the process may run on in ascending order, they may have gaps,
+    //every cpu the machine reports where the affinity mask can't be read
+    inline std::vector<uint32_t> read_allowed_cpus() {
+        std::vector<uint32_t> cpus;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (uint32_t cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+#endif
+        if (cpus.empty()) {
+            for (uint32_t cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    //read once at first use, the mask the process started with
+    inline const std::vector<uint32_t>& allowed_cpus() {
+        static const std::vector<uint32_t> cpus = read_allowed_cpus();
+        return cpus;
+    }
+
+    //cpu of a worker placed nowhere in particular, workers take the allowed cpus in turn
+    inline uint32_t worker_cpu(size_t worker) {
+        const auto& cpus = allowed_cpus();
+        return cpus[worker % cpus.size()];
+    }
+
+    //pins the calling thread to one cpu, false where unsupported or for a cpu the process may not run on,
+    //which is logged and left unpinned rather than moved to some other core
+    inline bool pin_current_thread(size_t cpu) {
+#ifdef __linux__
+        const auto& allowed = allowed_cpus();
+        if (!std::binary_search(allowed.begin(), allowed.end(), static_cast<uint32_t>(cpu))) {
+            log_write->warn("aff::pin_current_thread cpu {} is not in the process cpu set, thread left unpinned", cpu);
+            return false;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (rc != 0) {
+            log_write->warn("aff::pin_current_thread cpu {} error:{}", cpu, rc);
+            return false;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+}
@@ -0,0 +1,281 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define AGG_SSE2 1
+#endif
+#include "arena.h"
+#include "sketch.h"
+
+//statistics of one connection's values composed at compile time: a transform applied to every number,
+//a uniqueness policy picking the value store and the aggregations kept, no virtual call on the way
+namespace agg {
+
+    //sum of 64 bit values, two words so squares of 32 bit numbers never overflow it
+    struct u128 {
+        uint64_t lo{ 0 };
+        uint64_t hi{ 0 };
+
+        void add(uint64_t v) {
+            lo += v;
+            hi += lo < v;
+        }
+
+        void sub(uint64_t v) {
+            hi -= lo < v;
+            lo -= v;
+        }
+
+        void sub(const u128& o) {
+            hi -= o.hi + (lo < o.lo);
+            lo -= o.lo;
+        }
+
+        //the quotient must fit 64 bits, true for the mean of 64 bit values
+        uint64_t divide(uint64_t d) const {
+#if defined(__SIZEOF_INT128__)
+            return static_cast<uint64_t>(((static_cast<unsigned __int128>(hi) << 64) | lo) / d);
+#elif defined(_MSC_VER) && defined(_M_X64) && _MSC_VER >= 1920
+            uint64_t rem;
+            return _udiv128(hi, lo, d, &rem);
+#else
+            uint64_t q{ 0 }, r{ hi };
+            for (int bit = 63; bit >= 0; --bit) {
+                bool carry = (r >> 63) != 0;
+                r = (r << 1) | ((lo >> bit) & 1);
+                if (carry || r >= d) {
+                    r -= d;
+                    q |= 1ULL << bit;
+                }
+            }
+            return q;
+#endif
+        }
+    };
+
+    //transforms, the batch form fills out[i] for n[i], two numbers a step where SSE2 is there
+    struct square {
+        static uint64_t apply(uint32_t n) {
+            return static_cast<uint64_t>(n) * n;
+        }
+
+        static void apply(const uint32_t* n, size_t count, uint64_t* out) {
+            size_t i{ 0 };
+#ifdef AGG_SSE2
+            for (; i + 4 <= count; i += 4) {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(n + i));
+                __m128i odd = _mm_srli_epi64(x, 32);
+                __m128i even_squares = _mm_mul_epu32(x, x);          //n[i], n[i + 2]
+                __m128i odd_squares = _mm_mul_epu32(odd, odd);       //n[i + 1], n[i + 3]
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi64(even_squares, odd_squares));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 2), _mm_unpackhi_epi64(even_squares, odd_squares));
+            }
+#endif
+            for (; i < count; ++i) {
+                out[i] = apply(n[i]);
+            }
+        }
+    };
+
+    struct identity {
+        static uint64_t apply(uint32_t n) {
+            return n;
+        }
+
+        static void apply(const uint32_t* n, size_t count, uint64_t* out) {
+            size_t i{ 0 };
+#ifdef AGG_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 4 <= count; i += 4) {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(n + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi32(x, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 2), _mm_unpackhi_epi32(x, zero));
+            }
+#endif
+            for (; i < count; ++i) {
+                out[i] = apply(n[i]);
+            }
+        }
+    };
+
+    //uniqueness, the store keeps the values dumps are written from
+    struct distinct {
+        static constexpr bool unique = true;
+        using store = mem::flat_set;
+    };
+
+    struct all {
+        static constexpr bool unique = false;
+        using store = mem::flat_bag;
+    };
+
+    //aggregations: a state fed every counted value, its value, and an estimate from the sketch a distinct
+    //connection is folded into, idempotent ones are fed repeats too and stay exact in the sketched mode
+    struct mean {
+        struct state {
+            u128 sum;
+            uint64_t n{ 0 };
+            void add(uint64_t v) {
+                sum.add(v);
+                ++n;
+            }
+        };
+        static constexpr bool idempotent = false;
+        static const char* name() {
+            return "mean";
+        }
+        static uint64_t value(const state& s) {
+            return s.n ? s.sum.divide(s.n) : 0;
+        }
+        static uint64_t estimate(const state&, const skt::distinct_sketch& sk) {
+            return sk.mean();
+        }
+    };
+
+    struct count {
+        struct state {
+            uint64_t n{ 0 };
+            void add(uint64_t) {
+                ++n;
+            }
+        };
+        static constexpr bool idempotent = false;
+        static const char* name() {
+            return "count";
+        }
+        static uint64_t value(const state& s) {
+            return s.n;
+        }
+        static uint64_t estimate(const state&, const skt::distinct_sketch& sk) {
+            return sk.count();
+        }
+    };
+
+    struct min {
+        struct state {
+            uint64_t v{ std::numeric_limits<uint64_t>::max() };
+            void add(uint64_t x) {
+                v = std::min(v, x);
+            }
+        };
+        static constexpr bool idempotent = true;
+        static const char* name() {
+            return "min";
+        }
+        static uint64_t value(const state& s) {
+            return s.v;
+        }
+        static uint64_t estimate(const state& s, const skt::distinct_sketch&) {
+            return value(s);
+        }
+    };
+
+    struct max {
+        struct state {
+            uint64_t v{ 0 };
+            void add(uint64_t x) {
+                v = std::max(v, x);
+            }
+        };
+        static constexpr bool idempotent = true;
+        static const char* name() {
+            return "max";
+        }
+        static uint64_t value(const state& s) {
+            return s.v;
+        }
+        static uint64_t estimate(const state& s, const skt::distinct_sketch&) {
+            return value(s);
+        }
+    };
+
+    //population variance, Welford's update keeps it stable in doubles
+    struct variance {
+        struct state {
+            uint64_t n{ 0 };
+            double mean{ 0 };
+            double m2{ 0 };
+            void add(uint64_t v) {
+                double x = static_cast<double>(v);
+                double delta = x - mean;
+                mean += delta / static_cast<double>(++n);
+                m2 += delta * (x - mean);
+            }
+        };
+        static constexpr bool idempotent = false;
+        static const char* name() {
+            return "variance";
+        }
+        static uint64_t value(const state& s) {
+            return s.n ? static_cast<uint64_t>(std::llround(s.m2 / static_cast<double>(s.n))) : 0;
+        }
+        static uint64_t estimate(const state&, const skt::distinct_sketch& sk) {
+            return static_cast<uint64_t>(std::llround(sk.variance()));
+        }
+    };
+
+    //states of every aggregation side by side, trivially copyable so hot restart images copy it as is
+    template<class... Stats>
+    class accumulator final : private Stats::state... {
+        static_assert(sizeof...(Stats) > 0, "agg::accumulator needs at least one aggregation");
+    public:
+        static constexpr size_t size = sizeof...(Stats);
+
+        void add(uint64_t v) {
+            int expand[] = { 0, (static_cast<typename Stats::state&>(*this).add(v), 0)... };
+            (void)expand;
+        }
+
+        //a value that may have been counted already, only idempotent aggregations take it
+        void add_repeat(uint64_t v) {
+            int expand[] = { 0, (add_if_idempotent<Stats>(v), 0)... };
+            (void)expand;
+        }
+
+        //the first aggregation is the one replies carry
+        uint64_t result(const skt::distinct_sketch* sketch) const {
+            return get<typename std::tuple_element<0, std::tuple<Stats...>>::type>(sketch);
+        }
+
+        //"name:value" pairs of every aggregation
+        std::string describe(const skt::distinct_sketch* sketch) const {
+            std::string out;
+            int expand[] = { 0, (append<Stats>(out, sketch), 0)... };
+            (void)expand;
+            return out;
+        }
+    private:
+        //sketch is the distinct connection's sketch once it was folded, nullptr while exact
+        template<class Stat>
+        uint64_t get(const skt::distinct_sketch* sketch) const {
+            const auto& s = static_cast<const typename Stat::state&>(*this);
+            return sketch && !Stat::idempotent ? Stat::estimate(s, *sketch) : Stat::value(s);
+        }
+
+        template<class Stat>
+        void add_if_idempotent(uint64_t v) {
+            if (Stat::idempotent) {
+                static_cast<typename Stat::state&>(*this).add(v);
+            }
+        }
+
+        template<class Stat>
+        void append(std::string& out, const skt::distinct_sketch* sketch) const {
+            if (!out.empty()) {
+                out += ' ';
+            }
+            out += Stat::name();
+            out += ':';
+            out += std::to_string(get<Stat>(sketch));
+        }
+    };
+}
@@ -0,0 +1,457 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#endif
+
+namespace mem {
+
+    constexpr size_t FIRST_SLAB = 4096;
+    constexpr size_t HUGE_SLAB = 2 * 1024 * 1024;       //slabs from this size on are mapped on huge page boundaries
+    constexpr size_t ARENA_ALIGN = alignof(std::max_align_t);
+    constexpr size_t PREFETCH_BATCH = 16;               //slots a batch insert fetches before it probes the first
+
+    inline void prefetch(const void* p) {
+#ifdef _MSC_VER
+        _mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#else
+        __builtin_prefetch(p);
+#endif
+    }
+
+    //monotonic arena of one connection's state: allocations bump a pointer inside slabs that double up to
+    //HUGE_SLAB, nothing is freed on its own, the destructor gives every slab back at once
+    class arena final {
+        struct slab {
+            slab* next;
+            size_t size;
+            bool mapped;
+        };
+        static constexpr size_t HEADER = (sizeof(slab) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    public:
+        arena() = default;
+        arena(const arena&) = delete;
+        arena(arena&&) = delete;
+        arena& operator=(const arena&) = delete;
+        arena& operator= (arena&&) = delete;
+
+        ~arena() {
+            release();
+        }
+
+        void* allocate(size_t sz, size_t align = ARENA_ALIGN) {
+            size_t pos = (top + align - 1) & ~(align - 1);
+            if (head == nullptr || pos + sz > head->size) {
+                add_slab(sz + align);
+                pos = (top + align - 1) & ~(align - 1);
+            }
+            top = pos + sz;
+            return reinterpret_cast<uint8_t*>(head) + pos;
+        }
+
+        template<class T>
+        T* allocate_array(size_t n) {
+            return static_cast<T*>(allocate(n * sizeof(T), alignof(T)));
+        }
+
+        //bytes taken from the system, slab headers and unused tails included
+        size_t reserved() const {
+            return reserved_bytes;
+        }
+
+        void release() {
+            while (head) {
+                slab* next = head->next;
+                free_slab(head);
+                head = next;
+            }
+            top = 0;
+            reserved_bytes = 0;
+        }
+    private:
+        void add_slab(size_t need) {
+            size_t size = head ? std::min(head->size * 2, HUGE_SLAB) : FIRST_SLAB;
+            if (size < need + HEADER) {
+                size_t unit = need + HEADER >= HUGE_SLAB ? HUGE_SLAB : FIRST_SLAB;     //an oversized request gets a slab of its own size
+                size = (need + HEADER + unit - 1) / unit * unit;
+            }
+            slab* s = size >= HUGE_SLAB ? map_slab(size) : nullptr;
+            if (s == nullptr) {
+                s = static_cast<slab*>(::operator new(size));
+                s->mapped = false;
+            }
+            s->next = head;
+            s->size = size;
+            head = s;
+            top = HEADER;
+            reserved_bytes += size;
+        }
+
+        //huge page aligned anonymous mapping with transparent huge pages asked for, nullptr where unavailable
+        static slab* map_slab(size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+            size_t span = size + HUGE_SLAB;
+            void* p = ::mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                return nullptr;
+            }
+            uintptr_t base = reinterpret_cast<uintptr_t>(p);
+            uintptr_t aligned = (base + HUGE_SLAB - 1) & ~(HUGE_SLAB - 1);
+            if (aligned > base) {
+                ::munmap(p, aligned - base);
+            }
+            if (base + span > aligned + size) {
+                ::munmap(reinterpret_cast<void*>(aligned + size), base + span - aligned - size);
+            }
+            ::madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+            slab* s = reinterpret_cast<slab*>(aligned);
+            s->mapped = true;
+            return s;
+#else
+            (void)size;
+            return nullptr;
+#endif
+        }
+
+        static void free_slab(slab* s) {
+#ifdef __linux__
+            if (s->mapped) {
+                ::munmap(s, s->size);
+                return;
+            }
+#endif
+            ::operator delete(s);
+        }
+
+        slab* head{ nullptr };
+        size_t top{ 0 };
+        size_t reserved_bytes{ 0 };
+    };
+
+    //open addressing set of 64 bit values with linear probing, its table lives in an arena,
+    //a grown table leaves the old one behind in the arena, at most as much as the live one
+    class flat_set final {
+    public:
+        static constexpr uint64_t EMPTY = UINT64_MAX;
+        static constexpr size_t INITIAL_CAPACITY = 16;
+
+        explicit flat_set(arena& a_) : a(a_) {}
+        flat_set(const flat_set&) = delete;
+        flat_set& operator=(const flat_set&) = delete;
+
+        bool insert(uint64_t v) {
+            if (v == EMPTY) {
+                if (has_empty) {
+                    return false;
+                }
+                has_empty = true;
+                ++count;
+                return true;
+            }
+            if ((stored + 1) * 4 > capacity * 3) {
+                grow();
+            }
+            size_t mask = capacity - 1;
+            return place(v, mix(v) & mask, mask);
+        }
+
+        //n values a chunk at a time: the table is grown for the whole chunk, then the home slots of the chunk
+        //are hashed and prefetched before the first is probed, so the cache misses overlap instead of queueing,
+        //on_new gets every value that was not in the set yet, the number of them is returned
+        template<class F>
+        size_t insert(const uint64_t* v, size_t n, F&& on_new) {
+            size_t fresh{ 0 };
+            size_t home[PREFETCH_BATCH];
+            while (n) {
+                size_t batch = std::min(n, PREFETCH_BATCH);
+                while ((stored + batch) * 4 > capacity * 3) {
+                    grow();
+                }
+                size_t mask = capacity - 1;
+                for (size_t i = 0; i < batch; ++i) {
+                    home[i] = mix(v[i]) & mask;
+                    prefetch(slots + home[i]);
+                }
+                for (size_t i = 0; i < batch; ++i) {
+                    if (v[i] == EMPTY ? insert(v[i]) : place(v[i], home[i], mask)) {
+                        on_new(v[i]);
+                        ++fresh;
+                    }
+                }
+                v += batch;
+                n -= batch;
+            }
+            return fresh;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        template<class F>
+        void for_each(F&& f) const {
+            for (size_t i = 0; i < capacity; ++i) {
+                if (slots[i] != EMPTY) {
+                    f(slots[i]);
+                }
+            }
+            if (has_empty) {
+                f(EMPTY);
+            }
+        }
+
+        //forgets the table, its memory goes back with the arena
+        void clear() {
+            slots = nullptr;
+            capacity = 0;
+            stored = 0;
+            count = 0;
+            has_empty = false;
+        }
+
+        template<class Out>
+        void copy_to(Out& out) const {
+            out.clear();
+            out.reserve(count);
+            for_each([&out](uint64_t v) { out.push_back(v); });
+        }
+    private:
+        static uint64_t mix(uint64_t v) {
+            v ^= v >> 33;
+            v *= 0xff51afd7ed558ccdULL;
+            v ^= v >> 33;
+            return v;
+        }
+
+        //the table has room for v, probing starts at its home slot
+        bool place(uint64_t v, size_t i, size_t mask) {
+            for (;; i = (i + 1) & mask) {
+                if (slots[i] == EMPTY) {
+                    slots[i] = v;
+                    ++stored;
+                    ++count;
+                    return true;
+                }
+                if (slots[i] == v) {
+                    return false;
+                }
+            }
+        }
+
+        void grow() {
+            size_t fresh_capacity = capacity ? capacity * 2 : INITIAL_CAPACITY;
+            uint64_t* fresh = a.allocate_array<uint64_t>(fresh_capacity);
+            std::fill(fresh, fresh + fresh_capacity, EMPTY);
+            size_t mask = fresh_capacity - 1;
+            for (size_t i = 0; i < capacity; ++i) {
+                if (slots[i] != EMPTY) {
+                    size_t j = mix(slots[i]) & mask;
+                    while (fresh[j] != EMPTY) {
+                        j = (j + 1) & mask;
+                    }
+                    fresh[j] = slots[i];
+                }
+            }
+            slots = fresh;
+            capacity = fresh_capacity;
+        }
+
+        arena& a;
+        uint64_t* slots{ nullptr };
+        size_t capacity{ 0 };
+        size_t stored{ 0 };             //values in the table, EMPTY itself is kept aside
+        size_t count{ 0 };
+        bool has_empty{ false };
+    };
+
+    //open addressing map of 64 bit keys to 64 bit payloads, the flat_set layout with the payload next to
+    //each key, nothing is erased, an owner that needs to forget keys builds a fresh map in another arena
+    class flat_map final {
+        struct slot {
+            uint64_t key;
+            uint64_t value;
+        };
+    public:
+        static constexpr uint64_t EMPTY = UINT64_MAX;
+        static constexpr size_t INITIAL_CAPACITY = 16;
+
+        explicit flat_map(arena& a_) : a(a_) {}
+        flat_map(const flat_map&) = delete;
+        flat_map& operator=(const flat_map&) = delete;
+
+        //payload of key, a new key gets a zero payload and inserted set
+        uint64_t& emplace(uint64_t key, bool& inserted) {
+            inserted = false;
+            if (key == EMPTY) {
+                if (!has_empty) {
+                    has_empty = true;
+                    empty_value = 0;
+                    inserted = true;
+                    ++count;
+                }
+                return empty_value;
+            }
+            if ((count + 1) * 4 > capacity * 3) {
+                grow();
+            }
+            size_t mask = capacity - 1;
+            for (size_t i = mix(key) & mask;; i = (i + 1) & mask) {
+                if (slots[i].key == EMPTY) {
+                    slots[i] = { key, 0 };
+                    inserted = true;
+                    ++count;
+                    return slots[i].value;
+                }
+                if (slots[i].key == key) {
+                    return slots[i].value;
+                }
+            }
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        template<class F>
+        void for_each(F&& f) const {
+            for (size_t i = 0; i < capacity; ++i) {
+                if (slots[i].key != EMPTY) {
+                    f(slots[i].key, slots[i].value);
+                }
+            }
+            if (has_empty) {
+                f(EMPTY, empty_value);
+            }
+        }
+    private:
+        static uint64_t mix(uint64_t v) {
+            v ^= v >> 33;
+            v *= 0xff51afd7ed558ccdULL;
+            v ^= v >> 33;
+            return v;
+        }
+
+        void grow() {
+            size_t fresh_capacity = capacity ? capacity * 2 : INITIAL_CAPACITY;
+            slot* fresh = a.allocate_array<slot>(fresh_capacity);
+            std::fill(fresh, fresh + fresh_capacity, slot{ EMPTY, 0 });
+            size_t mask = fresh_capacity - 1;
+            for (size_t i = 0; i < capacity; ++i) {
+                if (slots[i].key != EMPTY) {
+                    size_t j = mix(slots[i].key) & mask;
+                    while (fresh[j].key != EMPTY) {
+                        j = (j + 1) & mask;
+                    }
+                    fresh[j] = slots[i];
+                }
+            }
+            slots = fresh;
+            capacity = fresh_capacity;
+        }
+
+        arena& a;
+        slot* slots{ nullptr };
+        size_t capacity{ 0 };
+        size_t count{ 0 };
+        uint64_t empty_value{ 0 };
+        bool has_empty{ false };
+    };
+
+    //every value in arrival order, repeats included, in arena chunks that double as the bag grows
+    class flat_bag final {
+        struct chunk {
+            chunk* next;
+            size_t capacity;
+            size_t used;
+            uint64_t* values;
+        };
+    public:
+        static constexpr size_t INITIAL_CAPACITY = 16;
+
+        explicit flat_bag(arena& a_) : a(a_) {}
+        flat_bag(const flat_bag&) = delete;
+        flat_bag& operator=(const flat_bag&) = delete;
+
+        //always new, the set interface's answer
+        bool insert(uint64_t v) {
+            if (last == nullptr || last->used == last->capacity) {
+                add_chunk();
+            }
+            last->values[last->used++] = v;
+            ++count;
+            return true;
+        }
+
+        //appends n values a chunk at a time, every one of them is new
+        template<class F>
+        size_t insert(const uint64_t* v, size_t n, F&& on_new) {
+            for (size_t left = n; left;) {
+                if (last == nullptr || last->used == last->capacity) {
+                    add_chunk();
+                }
+                size_t batch = std::min(left, last->capacity - last->used);
+                std::copy(v, v + batch, last->values + last->used);
+                last->used += batch;
+                count += batch;
+                for (size_t i = 0; i < batch; ++i) {
+                    on_new(v[i]);
+                }
+                v += batch;
+                left -= batch;
+            }
+            return n;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        template<class F>
+        void for_each(F&& f) const {
+            for (const chunk* c = first; c; c = c->next) {
+                for (size_t i = 0; i < c->used; ++i) {
+                    f(c->values[i]);
+                }
+            }
+        }
+
+        void clear() {
+            first = last = nullptr;
+            count = 0;
+        }
+
+        template<class Out>
+        void copy_to(Out& out) const {
+            out.clear();
+            out.reserve(count);
+            for_each([&out](uint64_t v) { out.push_back(v); });
+        }
+    private:
+        void add_chunk() {
+            size_t capacity = last ? last->capacity * 2 : INITIAL_CAPACITY;
+            chunk* c = static_cast<chunk*>(a.allocate(sizeof(chunk), alignof(chunk)));
+            c->next = nullptr;
+            c->capacity = capacity;
+            c->used = 0;
+            c->values = a.allocate_array<uint64_t>(capacity);
+            if (last) {
+                last->next = c;
+            }
+            else {
+                first = c;
+            }
+            last = c;
+        }
+
+        arena& a;
+        chunk* first{ nullptr };
+        chunk* last{ nullptr };
+        size_t count{ 0 };
+    };
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+#include "logger.h"
+#include "global_stats.h"
+#include "SrvAlg.h"
+
+namespace bnc {
+
+    constexpr uint32_t BENCH_CONNECTIONS = 4;
+    constexpr uint32_t BENCH_SEED = 7;
+
+    //feeds count numbers to a fresh storage in frames of frame numbers, one number at a time or a frame at once,
+    //spread over BENCH_CONNECTIONS connections, returns the time it took in us, what was stored lands in described
+    inline int64_t ingest(const std::vector<uint32_t>& numbers, size_t frame, bool batch, std::vector<std::string>& described) {
+        salg::storage_type storage;
+        storage.set_global(GLOBAL_STATS.make_partial());
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < numbers.size(); i += frame) {
+            uint32_t number_connection = static_cast<uint32_t>((i / frame) % BENCH_CONNECTIONS);
+            size_t n = std::min(frame, numbers.size() - i);
+            if (batch) {
+                storage.to_storage(number_connection, std::span<const uint32_t>(numbers.data() + i, n));
+            }
+            else {
+                for (size_t j = i; j < i + n; ++j) {
+                    storage.to_storage(number_connection, numbers[j]);
+                }
+            }
+        }
+        auto took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        described.assign(BENCH_CONNECTIONS, std::string());
+        for (uint32_t c = 0; c < BENCH_CONNECTIONS; ++c) {
+            storage.describe(c, described[c]);
+        }
+        return took;
+    }
+
+    //scalar against batch ingestion of count numbers for small, medium and large value ranges and short and long frames,
+    //false when the two paths disagree on what they stored
+    inline bool storage_ingest(uint64_t count) {
+        std::mt19937 rng(BENCH_SEED);
+        bool same{ true };
+        for (uint32_t range : { 1u << 10, 1u << 20, 1u << 24 }) {
+            std::vector<uint32_t> numbers(count);
+            for (auto& n : numbers) {
+                n = rng() % range;
+            }
+            for (size_t frame : { 16u, 256u }) {
+                std::vector<std::string> scalar_described, batch_described;
+                int64_t scalar_us = ingest(numbers, frame, false, scalar_described);
+                int64_t batch_us = ingest(numbers, frame, true, batch_described);
+                if (scalar_described != batch_described) {
+                    log_write->error("bench storage range {} frame {}: batch and scalar results differ", range, frame);
+                    same = false;
+                }
+                log_write->info("bench storage {} numbers range {} frame {}: scalar {} us {} ns per number, batch {} us {} ns per number",
+                    count, range, frame, scalar_us, count ? scalar_us * 1000 / count : 0, batch_us, count ? batch_us * 1000 / count : 0);
+            }
+        }
+        return same;
+    }
+}
@@ -1,7 +1,12 @@
 #pragma once
-#include "Logger.h"
+#include "logger.h"
+#include "metrics.h"
+#include "watchdog.h"
+#include "waiter.h"
 #include <boost/bind/bind.hpp>
 #include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <utility>
 
 #include <boost/asio.hpp>
 namespace con {
@@ -22,91 +27,228 @@ namespace con {
         { CONNECTION_CLOSE , "CONNECTION_CLOSE"}
     };
 
-    class tcp_connection : public boost::enable_shared_from_this<tcp_connection>{
+    //any failed read or write ends the connection, a socket that errored once is not read again
+    inline bool is_connection_lost(const boost::system::error_code& error) {
+        return static_cast<bool>(error);
+    }
+
+    //busy poll mode: replies leave at once, acks are not delayed and the socket is polled by the reading thread,
+    //options the kernel refuses are only logged, the connection works without them
+    inline void tune_low_latency(tcp::socket& socket, uint32_t busy_poll_us) {
+        boost::system::error_code ec;
+        socket.set_option(tcp::no_delay(true), ec);
+        if (ec) {
+            log_write->warn("tune_low_latency TCP_NODELAY error:{} message:{}", ec.value(), ec.message());
+        }
+#ifdef __linux__
+        int one = 1;
+        if (::setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one)) != 0) {
+            log_write->warn("tune_low_latency TCP_QUICKACK error:{}", errno);
+        }
+        int us = static_cast<int>(busy_poll_us);
+        if (us && ::setsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) != 0) {
+            static std::atomic_bool warned{ false };
+            if (!warned.exchange(true)) {
+                log_write->warn("tune_low_latency SO_BUSY_POLL {} us error:{}, raising it needs CAP_NET_ADMIN", us, errno);
+            }
+        }
+#endif
+    }
+
+    //nothing to tune on unix domain sockets
+    template<class Socket>
+    inline void tune_low_latency(Socket&, uint32_t) {}
+
+    //transport independent view of a client connection, polled by client_io
+    class connection {
+    public:
+        using pointer = boost::shared_ptr<connection>;
+
+        virtual ~connection() = default;
+        virtual void read() = 0;
+        virtual void write(uint8_t* data, size_t sz) = 0;
+        virtual RW_STATUS is_read() = 0;
+        virtual RW_STATUS is_write() = 0;
+        virtual bool is_open() = 0;
+        virtual size_t data_size() = 0;
+        virtual uint8_t* get_data() = 0;
+
+        //gives up the socket for a hot restart: pending operations are cancelled and a duplicate of
+        //the descriptor is returned, -1 if the transport can't hand its sockets over
+        virtual int release_handle() {
+            return -1;
+        }
+
+        //hot restart: stops the read in flight, its completion still reports the bytes of a number it got so far,
+        //transports whose reads complete on the polling thread have nothing to stop
+        virtual void cancel_read() {}
+
+        //bytes of a number the predecessor had read already, the next read completes the number with them
+        virtual void preload(const uint8_t* data, size_t sz) = 0;
+
+        //every stored number is answered with one reply carrying the current mean
+        void request_reply() {
+            ++replies_due;
+        }
+
+        bool reply_due() const {
+            return replies_due != 0;
+        }
+
+        size_t replies_pending() const {
+            return replies_due;
+        }
+
+        bool take_reply() {
+            if (replies_due == 0) {
+                return false;
+            }
+            --replies_due;
+            return true;
+        }
+
+        //completions wake the thread polling the connection
+        void set_waiter(wt::waiter* w) {
+            ready_waiter.store(w, std::memory_order_release);
+        }
+    protected:
+        void notify_ready() {
+            if (wt::waiter* w = ready_waiter.load(std::memory_order_acquire)) {
+                w->notify();
+            }
+        }
+    private:
+        size_t replies_due{ 0 };
+        std::atomic<wt::waiter*> ready_waiter{ nullptr };
+    };
+
+    //stream socket connection, Protocol is tcp or a local (unix domain) stream protocol
+    template<class Protocol>
+    class stream_connection : public connection, public boost::enable_shared_from_this<stream_connection<Protocol>>{
     public:
 
-        using pointer = boost::shared_ptr<tcp_connection> ;
+        using pointer = boost::shared_ptr<stream_connection> ;
+        using socket_type = typename Protocol::socket;
 
         static pointer create(boost::asio::io_context& io_context, size_t sz_read_buff)
         {
-            return pointer(new tcp_connection(io_context, sz_read_buff));
+            return pointer(new stream_connection(io_context, sz_read_buff));
         }
 
-        tcp::socket& socket()
+        socket_type& socket()
         {
             return socket_;
         }
 
-        void read() {
+        void read() override {
             is_current_read_end.store(RW_STATUS::IN_PROGRESS);
             memset(rd_buff.get(), 0, rd_buff_sz);
+            memcpy(rd_buff.get(), carried, carried_sz);
             read_data_sz = 0;
-            boost::asio::async_read(socket_, boost::asio::buffer(rd_buff.get(), rd_buff_sz),
-                boost::bind(&tcp_connection::handle_read, shared_from_this(),
+            read_offset = std::exchange(carried_sz, 0);
+            boost::asio::async_read(socket_, boost::asio::buffer(rd_buff.get() + read_offset, rd_buff_sz - read_offset),
+                boost::bind(&stream_connection::handle_read, this->shared_from_this(),
                 boost::asio::placeholders::error,
                 boost::asio::placeholders::bytes_transferred));
 
         }
 
-        void write(uint8_t* data, size_t sz){
+        void write(uint8_t* data, size_t sz) override {
             is_current_write_end.store(RW_STATUS::IN_PROGRESS);
-            boost::asio::async_write(socket_, boost::asio::buffer(data, sz),
-                boost::bind(&tcp_connection::handle_write, shared_from_this(),
+            wr_buff_sz = std::min(sz, sizeof(wr_buff));
+            memcpy(wr_buff, data, wr_buff_sz);
+            boost::asio::async_write(socket_, boost::asio::buffer(wr_buff, wr_buff_sz),
+                boost::bind(&stream_connection::handle_write, this->shared_from_this(),
                 boost::asio::placeholders::error,
                 boost::asio::placeholders::bytes_transferred));
         }
 
-        RW_STATUS is_read() {
+        RW_STATUS is_read() override {
             return is_current_read_end.load();
         }
 
-        RW_STATUS is_write() {
+        RW_STATUS is_write() override {
             return is_current_write_end.load();
         }
 
-        bool is_open() {
+        bool is_open() override {
             return socket_.is_open();
         }
 
-        size_t data_size() {
+        size_t data_size() override {
             return read_data_sz;
         }
-        uint8_t* get_data() {
+        uint8_t* get_data() override {
             return rd_buff.get();
         }
+
+        void preload(const uint8_t* data, size_t sz) override {
+            carried_sz = std::min({ sz, sizeof(carried), rd_buff_sz - 1 });
+            memcpy(carried, data, carried_sz);
+        }
+#ifndef _WIN32
+        void cancel_read() override {
+            boost::system::error_code ec;
+            socket_.cancel(ec);
+        }
+
+        int release_handle() override {
+            boost::system::error_code ec;
+            socket_.cancel(ec);
+            int fd = ::dup(socket_.native_handle());
+            socket_.close(ec);
+            return fd;
+        }
+#endif
     private:
-        tcp_connection(boost::asio::io_context& io_context, size_t sz_read_buff)
+        stream_connection(boost::asio::io_context& io_context, size_t sz_read_buff)
             : socket_(io_context) {
             rd_buff = std::make_unique<uint8_t[]>(sz_read_buff);
             rd_buff_sz = sz_read_buff;
         }
 
         void handle_read(const boost::system::error_code& error, size_t bytes_transferred) {
-            log_write->info("tcp_connection::handle_read: bytes transfered={} value={} string={}", bytes_transferred, error.value(), error.message().c_str());
-            if (error.value() == WSAECONNRESET || error.value() == WSAECONNABORTED) {
+            wdg::scope guard("stream_connection::handle_read");
+            log_write->info("stream_connection::handle_read: bytes transfered={} value={} string={}", bytes_transferred, error.value(), error.message().c_str());
+            read_data_sz = read_offset + bytes_transferred;     //published by the status store below
+            if (is_connection_lost(error)) {
                 is_current_read_end.store(RW_STATUS::CONNECTION_CLOSE);
             }
             else {
                 is_current_read_end.store(RW_STATUS::COMPLETE);
             }
-            read_data_sz = bytes_transferred;
+            METRICS.bytes_in.inc(bytes_transferred);
+            notify_ready();
         }
 
         void handle_write(const boost::system::error_code& error, size_t bytes_transferred) {
-            log_write->info("tcp_connection::handle_write: bytes transfered={} value={} string={}", bytes_transferred, error.value(), error.message().c_str());
-            if (error.value() == WSAECONNRESET || error.value() == WSAECONNABORTED) {
+            wdg::scope guard("stream_connection::handle_write");
+            log_write->info("stream_connection::handle_write: bytes transfered={} value={} string={}", bytes_transferred, error.value(), error.message().c_str());
+            if (is_connection_lost(error)) {
                 is_current_write_end.store(RW_STATUS::CONNECTION_CLOSE);
             }
             else {
                 is_current_write_end.store(RW_STATUS::COMPLETE);
             }
+            METRICS.bytes_out.inc(bytes_transferred);
+            notify_ready();
         }
     private:
-        tcp::socket socket_;
+        socket_type socket_;
         std::unique_ptr<uint8_t[]> rd_buff{};
         std::atomic<RW_STATUS> is_current_read_end{ RW_STATUS::UNKNOWN };
         std::atomic<RW_STATUS> is_current_write_end{ RW_STATUS::UNKNOWN };
         size_t rd_buff_sz{};
         size_t read_data_sz{};
+        size_t read_offset{};               //bytes of the number in rd_buff before the read was armed
+        uint8_t carried[sizeof(uint32_t)]{};
+        size_t carried_sz{};
+        uint8_t wr_buff[16]{};
+        size_t wr_buff_sz{};
     };
+
+    using tcp_connection = stream_connection<tcp>;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    using local_connection = stream_connection<boost::asio::local::stream_protocol>;
+#endif
 }
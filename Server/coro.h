@@ -0,0 +1,243 @@
+#pragma once
+#include <boost/asio.hpp>
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && __has_include(<coroutine>)
+#define SRV_HAS_COROUTINES 1
+#endif
+
+#ifdef SRV_HAS_COROUTINES
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include "logger.h"
+
+namespace cor {
+
+    constexpr size_t ARENA_SIZE = 4096;
+    constexpr size_t ARENA_ALIGN = alignof(std::max_align_t);
+
+    //memory of one connection: its coroutine frame and the asio operation in flight,
+    //a block freed right after it was taken is reused, everything else stays until the arena is empty
+    class frame_arena final {
+    public:
+        frame_arena() = default;
+        frame_arena(const frame_arena&) = delete;
+        frame_arena& operator=(const frame_arena&) = delete;
+
+        void* allocate(size_t sz) {
+            sz = (sz + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+            if (top + sz > ARENA_SIZE) {
+                ++spilled;
+                return ::operator new(sz);
+            }
+            void* p = buff + top;
+            last = top;
+            top += sz;
+            ++live;
+            return p;
+        }
+
+        void deallocate(void* p) {
+            uint8_t* b = static_cast<uint8_t*>(p);
+            if (b < buff || b >= buff + ARENA_SIZE) {
+                ::operator delete(p);
+                return;
+            }
+            if (--live == 0) {
+                top = 0;
+            }
+            else if (b == buff + last) {
+                top = last;
+            }
+            last = NO_LAST;
+        }
+
+        size_t spills() const {
+            return spilled;
+        }
+    private:
+        static constexpr size_t NO_LAST = static_cast<size_t>(-1);
+        alignas(ARENA_ALIGN) uint8_t buff[ARENA_SIZE];
+        size_t top{ 0 };
+        size_t last{ NO_LAST };
+        size_t live{ 0 };
+        size_t spilled{ 0 };
+    };
+
+    //associated allocator of the completion handlers, asio takes its operation memory from the arena
+    template<class T>
+    struct arena_allocator {
+        using value_type = T;
+
+        explicit arena_allocator(frame_arena* a_) noexcept : a(a_) {}
+        template<class U>
+        arena_allocator(const arena_allocator<U>& other) noexcept : a(other.a) {}
+
+        T* allocate(size_t n) {
+            return static_cast<T*>(a->allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* p, size_t) {
+            a->deallocate(p);
+        }
+
+        template<class U>
+        bool operator==(const arena_allocator<U>& other) const noexcept {
+            return a == other.a;
+        }
+        template<class U>
+        bool operator!=(const arena_allocator<U>& other) const noexcept {
+            return a != other.a;
+        }
+
+        frame_arena* a;
+    };
+
+    //fire and forget coroutine, runs eagerly and frees its frame when it returns,
+    //the first argument must be a shared pointer to an object with arena(), the frame is placed there
+    struct task {
+        struct promise_type {
+            task get_return_object() noexcept {
+                return {};
+            }
+            std::suspend_never initial_suspend() noexcept {
+                return {};
+            }
+            std::suspend_never final_suspend() noexcept {
+                return {};
+            }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept {
+                try {
+                    throw;
+                }
+                catch (std::exception& e) {
+                    log_write->error("cor::task unhandled exception: {}", e.what());
+                }
+                catch (...) {
+                    log_write->error("cor::task unknown exception");
+                }
+            }
+
+            //the frame keeps its arena alive, the owner may be gone by the time the frame is freed
+            template<class Owner, class... Rest>
+            static void* operator new(size_t sz, const std::shared_ptr<Owner>& owner, Rest&...) {
+                std::shared_ptr<frame_arena> arena = owner->arena();
+                void* p = arena->allocate(sz + HEADER);
+                new (p) std::shared_ptr<frame_arena>(std::move(arena));
+                return static_cast<uint8_t*>(p) + HEADER;
+            }
+
+            static void operator delete(void* frame, size_t) {
+                void* p = static_cast<uint8_t*>(frame) - HEADER;
+                auto* holder = static_cast<std::shared_ptr<frame_arena>*>(p);
+                std::shared_ptr<frame_arena> arena = std::move(*holder);
+                holder->~shared_ptr();
+                arena->deallocate(p);
+            }
+
+            static constexpr size_t HEADER = (sizeof(std::shared_ptr<frame_arena>) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+        };
+    };
+
+    struct io_result {
+        boost::system::error_code ec;
+        size_t bytes{ 0 };
+    };
+
+    //resumes the suspended coroutine, a handler dropped without a call (io_context shutdown) destroys the frame
+    class resume_handler {
+    public:
+        using allocator_type = arena_allocator<void>;
+
+        resume_handler(std::coroutine_handle<> h_, io_result* result_, frame_arena* a_) noexcept
+            : h(h_), result(result_), a(a_) {}
+        resume_handler(resume_handler&& other) noexcept
+            : h(std::exchange(other.h, nullptr)), result(other.result), a(other.a) {}
+        resume_handler(const resume_handler&) = delete;
+        resume_handler& operator=(const resume_handler&) = delete;
+
+        ~resume_handler() {
+            if (h) {
+                h.destroy();
+            }
+        }
+
+        allocator_type get_allocator() const noexcept {
+            return allocator_type(a);
+        }
+
+        void operator()(const boost::system::error_code& ec, size_t bytes) {
+            result->ec = ec;
+            result->bytes = bytes;
+            std::exchange(h, nullptr).resume();
+        }
+    private:
+        std::coroutine_handle<> h;
+        io_result* result;
+        frame_arena* a;
+    };
+
+    template<class Initiate>
+    class io_awaiter {
+    public:
+        io_awaiter(Initiate initiate_, frame_arena& a_) : initiate(std::move(initiate_)), a(a_) {}
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> h) {
+            initiate(resume_handler(h, &result, &a));
+        }
+        io_result await_resume() noexcept {
+            return result;
+        }
+    private:
+        Initiate initiate;
+        frame_arena& a;
+        io_result result;
+    };
+
+    template<class Stream, class Buffer>
+    auto async_read_some(Stream& s, const Buffer& b, frame_arena& a) {
+        auto initiate = [&s, b](resume_handler&& h) { s.async_read_some(b, std::move(h)); };
+        return io_awaiter<decltype(initiate)>(std::move(initiate), a);
+    }
+
+    template<class Stream, class Buffer>
+    auto async_write(Stream& s, const Buffer& b, frame_arena& a) {
+        auto initiate = [&s, b](resume_handler&& h) { boost::asio::async_write(s, b, std::move(h)); };
+        return io_awaiter<decltype(initiate)>(std::move(initiate), a);
+    }
+
+    //socket of a coroutine served connection and the arena its frame lives in
+    template<class Protocol>
+    class session final {
+    public:
+        using socket_type = typename Protocol::socket;
+
+        explicit session(socket_type&& socket__) : socket_(std::move(socket__)), arena_(std::make_shared<frame_arena>()) {}
+        session(const session&) = delete;
+        session& operator=(const session&) = delete;
+
+        ~session() {
+            if (arena_->spills()) {
+                log_write->info("cor::session {} allocations did not fit the arena", arena_->spills());
+            }
+        }
+
+        socket_type& socket() {
+            return socket_;
+        }
+
+        const std::shared_ptr<frame_arena>& arena() {
+            return arena_;
+        }
+    private:
+        socket_type socket_;
+        std::shared_ptr<frame_arena> arena_;
+    };
+}
+#endif
@@ -4,7 +4,13 @@
 #include <thread>
 #include <mutex>
 #include <fstream>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
 #include "SrvAlg.h"
+#include "metrics.h"
+#include "task_pool.h"
+#include "waiter.h"
 namespace srv {
 
     constexpr int DUMP_TIMEOUT = 5;
@@ -15,77 +21,117 @@ namespace srv {
             data_block(const data_block& db) {
                 number_connection = db.number_connection;
                 nums = db.nums;
+                histogram = db.histogram;
             }
-            data_block(uint32_t number_connection_, std::unordered_set<uint64_t>& numbers) : number_connection(number_connection_) {
-                nums.reserve(numbers.size());
-                std::copy(numbers.begin(), numbers.end(), std::back_inserter(nums));
+            data_block(uint32_t number_connection_, std::vector<uint64_t>&& numbers, std::vector<uint64_t>&& histogram_)
+                : number_connection(number_connection_), nums(std::move(numbers)), histogram(std::move(histogram_)) {
             }
             data_block(data_block&& db) noexcept {
                 number_connection = db.number_connection;
                 nums = std::move(db.nums);
+                histogram = std::move(db.histogram);
             }
             data_block& operator= (data_block&& db) noexcept{
                 number_connection = db.number_connection;
                 nums = std::move(db.nums);
+                histogram = std::move(db.histogram);
                 return *this;
             }
             uint32_t number_connection{};
             std::vector<uint64_t> nums;
+            std::vector<uint64_t> histogram;        //bin counts, empty without a histogram
         };
 
-        struct data_block_hash {
-            size_t operator () (const data_block& db) const {
-                return std::hash<uint32_t>()(db.number_connection);
-            }
-        };
-
-        struct data_block_equal {
-            bool operator()(const data_block& _left, const data_block& _right) const {
-                return _left.number_connection == _right.number_connection;
-            }
-        };
     public:
         dump_writer() {
             thr_dump = std::thread(std::bind(&dump_writer::dump_func, this));
         }
         ~dump_writer() {
-            {
-                std::unique_lock<std::mutex> lock(this->mutex_);
-                active = false;
+            stop();
+            flush();
+        }
+        void to_dump(uint32_t number_connection, std::vector<uint64_t>&& numbers, std::vector<uint64_t>&& histogram = {}) {
+            log_write->info("dump_writer::to_dump number connection:{} size set:{}", number_connection, numbers.size());
+            pq.push(data_block(number_connection, std::move(numbers), std::move(histogram)));
+            publish_queue_depth();
+        }
+
+        //bins the histogram counts of later dumps are written against
+        void set_histogram_layout(const hst::layout& l) {
+            bounds = l.boundaries();
+        }
+
+        //ends the periodic dump thread, whatever is still queued is left for flush
+        void stop() {
+            if (!active.exchange(false)) {
+                return;
             }
-            cv_.notify_one();
+            pause.notify();
             thr_dump.join();
         }
-        void to_dump(uint32_t number_connection, std::unordered_set<uint64_t>& numbers) {
-            log_write->info("dump_writer::to_dump number connection:{} size set:{}", number_connection, numbers.size());
-            pq.push(data_block(number_connection, numbers));
-            {    std::unique_lock<std::mutex> lock(mutex_);    }
-            cv_.notify_one();
+
+        //writes everything queued, one file per connection
+        void flush() {
+            save_dumps();
+        }
+
+        //queued and later blocks are dropped unwritten, a successor process owns the files from now on
+        void discard() {
+            discarding.store(true);
         }
     private:
         void dump_func() {
-            active = true;
-            auto save_dumps = [&] {
-                std::unordered_set<data_block, data_block_hash, data_block_equal> blocks;
-                data_block db;
-                while (pq.pop(db)) {
-                    blocks.emplace(db);
-                }
-                for (auto &blk : blocks) {
-                    save_dump_to_file(blk);
-                }
-                
-            };
             for (;;) {
                 save_dumps();
-                {
-                    std::unique_lock<std::mutex> lock(mutex_);
-                    if (cv_.wait_for(lock, std::chrono::seconds(DUMP_TIMEOUT), [this] { return !active; })) {
-                        save_dumps();
-                        break;
-                    }
+                pause.wait_for(std::chrono::seconds(DUMP_TIMEOUT), [this] { return !active.load(); });
+                if (!active.load()) {
+                    break;
+                }
+            }
+        }
+
+        //only the newest block of every connection is written
+        std::vector<data_block> collect_blocks() {
+            std::unordered_map<uint32_t, size_t> index;
+            std::vector<data_block> blocks;
+            data_block db;
+            while (pq.pop(db)) {
+                auto it = index.find(db.number_connection);
+                if (it != index.end()) {
+                    blocks[it->second] = std::move(db);
+                }
+                else {
+                    index.emplace(db.number_connection, blocks.size());
+                    blocks.push_back(std::move(db));
+                }
+            }
+            publish_queue_depth();
+            return blocks;
+        }
+
+        //every file is a pool task, a huge connection occupies one worker while idle ones steal the rest
+        void save_dumps() {
+            std::vector<data_block> blocks = collect_blocks();
+            if (blocks.empty() || discarding.load()) {
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            {
+                tsk::group writers(TASK_POOL);
+                for (auto& blk : blocks) {
+                    writers.run([this, &blk] { save_dump_to_file(blk); });
                 }
+                writers.wait();
             }
+            METRICS.dump_cycles.inc();
+            METRICS.dump_cycle_ms.observe(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+            log_write->info("dump_writer::save_dumps {} files written by {} pool workers", blocks.size(), TASK_POOL.size());
+        }
+
+        //the gauge is shared by every dump_writer, each one adds its own change
+        void publish_queue_depth() {
+            int64_t depth = static_cast<int64_t>(pq.size());
+            METRICS.dump_queue_depth.add(depth - published_depth.exchange(depth));
         }
 
         bool exists_file(const std::string& name) {
@@ -105,15 +151,43 @@ namespace srv {
             for (auto num : db.nums) {
                 ofs << num;
             }
+            METRICS.dump_bytes.inc(static_cast<uint64_t>(ofs.tellp()));
             ofs.close();
             log_write->info("save_dump_to_file number connection:{} close written file:{}", db.number_connection, name_file.c_str());
+            if (!db.histogram.empty()) {
+                save_histogram_to_file(db);
+            }
+        }
+
+        //one "from to count" line per bin, the last bin is open ended
+        void save_histogram_to_file(const data_block& db) {
+            if (db.histogram.size() != bounds.size() + 1) {
+                log_write->warn("save_histogram_to_file number connection:{} {} bins don't match the layout", db.number_connection, db.histogram.size());
+                return;
+            }
+            std::string name_file = std::to_string(db.number_connection) + ".hst";
+            std::ofstream ofs(name_file, std::ofstream::trunc);
+            for (size_t b = 0; b < db.histogram.size(); ++b) {
+                uint64_t from = b == 0 ? 0 : bounds[b - 1];
+                ofs << from << ' ';
+                if (b < bounds.size()) {
+                    ofs << bounds[b];
+                }
+                else {
+                    ofs << "inf";
+                }
+                ofs << ' ' << db.histogram[b] << '\n';
+            }
+            METRICS.dump_bytes.inc(static_cast<uint64_t>(ofs.tellp()));
         }
     private:
         std::thread thr_dump{};
         salg::parallel_queue<data_block> pq{};
-        std::mutex mutex_;
-        std::condition_variable cv_;
-        bool active{ false };
+        wt::waiter pause;
+        std::atomic_bool active{ true };
+        std::atomic_bool discarding{ false };
+        std::atomic<int64_t> published_depth{ 0 };
+        std::vector<uint32_t> bounds;
     };
 
 }
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+
+namespace ept {
+
+    enum class transport : uint8_t {
+        TCP,
+        UNIX,
+        SHM,
+        UDP
+    };
+
+    struct endpoint_uri {
+        transport kind{ transport::TCP };
+        std::string host;
+        uint16_t port{};
+        std::string path;                   //socket path or shared memory segment name
+    };
+
+    //tcp://host:port, udp://host:port, unix:///absolute/path or shm://segment, a bare host:port is taken as tcp
+    inline endpoint_uri parse(const std::string& uri) {
+        const std::string tcp_scheme("tcp://");
+        const std::string udp_scheme("udp://");
+        const std::string unix_scheme("unix://");
+        const std::string shm_scheme("shm://");
+        endpoint_uri ep;
+        if (uri.compare(0, shm_scheme.size(), shm_scheme) == 0) {
+            ep.kind = transport::SHM;
+            ep.path = uri.substr(shm_scheme.size());
+            if (ep.path.empty()) {
+                throw std::invalid_argument("endpoint " + uri + " has no segment name");
+            }
+            return ep;
+        }
+        if (uri.compare(0, unix_scheme.size(), unix_scheme) == 0) {
+            ep.kind = transport::UNIX;
+            ep.path = uri.substr(unix_scheme.size());
+            if (ep.path.empty()) {
+                throw std::invalid_argument("endpoint " + uri + " has no socket path");
+            }
+            return ep;
+        }
+        std::string rest = uri;
+        if (uri.compare(0, udp_scheme.size(), udp_scheme) == 0) {
+            ep.kind = transport::UDP;
+            rest = uri.substr(udp_scheme.size());
+        }
+        else if (uri.compare(0, tcp_scheme.size(), tcp_scheme) == 0) {
+            rest = uri.substr(tcp_scheme.size());
+        }
+        auto pos = rest.rfind(':');
+        if (pos == std::string::npos || pos == 0 || pos + 1 == rest.size()) {
+            throw std::invalid_argument("endpoint " + uri + " is not host:port");
+        }
+        ep.host = rest.substr(0, pos);
+        unsigned long port = std::stoul(rest.substr(pos + 1));
+        if (port > UINT16_MAX) {
+            throw std::invalid_argument("endpoint " + uri + " port out of range");
+        }
+        ep.port = static_cast<uint16_t>(port);
+        return ep;
+    }
+
+    inline std::string to_string(const endpoint_uri& ep) {
+        if (ep.kind == transport::UNIX) {
+            return "unix://" + ep.path;
+        }
+        if (ep.kind == transport::SHM) {
+            return "shm://" + ep.path;
+        }
+        return (ep.kind == transport::UDP ? "udp://" : "tcp://") + ep.host + ":" + std::to_string(ep.port);
+    }
+}
@@ -0,0 +1,174 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include "agg.h"
+#include "metrics.h"
+#include "sketch.h"
+
+//fleet wide numbers without a scan of storage: every client_io thread keeps a partial aggregate of the values
+//it receives, a reader merges the partials, so a read costs the number of threads, not of connections
+namespace gst {
+
+    struct summary {
+        uint64_t messages{ 0 };
+        agg::u128 sum;
+        uint64_t mean{ 0 };
+        uint64_t distinct{ 0 };         //HyperLogLog estimate of distinct values over every connection
+        size_t partials{ 0 };
+    };
+
+    //written by its owner thread only, the sum sits behind a sequence counter so a reader never sees
+    //half of a carry, registers are single bytes that only grow and are read without it
+    class alignas(64) partial final {
+    public:
+        partial() {
+            for (auto& r : registers) {
+                r.store(0, std::memory_order_relaxed);
+            }
+        }
+        partial(const partial&) = delete;
+        partial& operator=(const partial&) = delete;
+
+        void observe(uint64_t v) {
+            agg::u128 sum;
+            sum.add(v);
+            add_sum(sum, 1);
+            raise(v);
+        }
+
+        //a batch is summed aside and goes through the sequence counter once
+        void observe(const uint64_t* v, size_t n) {
+            agg::u128 sum;
+            for (size_t i = 0; i < n; ++i) {
+                sum.add(v[i]);
+            }
+            add_sum(sum, n);
+            for (size_t i = 0; i < n; ++i) {
+                raise(v[i]);
+            }
+        }
+
+        void merge_into(summary& out, skt::hll& distinct) const {
+            uint64_t lo, hi, n;
+            for (;;) {
+                uint64_t before = seq.load(std::memory_order_acquire);
+                lo = sum_lo.load(std::memory_order_relaxed);
+                hi = sum_hi.load(std::memory_order_relaxed);
+                n = messages.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if ((before & 1) == 0 && seq.load(std::memory_order_relaxed) == before) {
+                    break;
+                }
+            }
+            uint64_t carry = out.sum.lo + lo < lo;
+            out.sum.lo += lo;
+            out.sum.hi += hi + carry;
+            out.messages += n;
+            for (uint32_t i = 0; i < skt::HLL_REGISTERS; ++i) {
+                distinct.raise(i, registers[i].load(std::memory_order_relaxed));
+            }
+        }
+    private:
+        void add_sum(const agg::u128& sum, uint64_t n) {
+            uint64_t s = seq.load(std::memory_order_relaxed);
+            seq.store(s + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            uint64_t lo = sum_lo.load(std::memory_order_relaxed) + sum.lo;
+            sum_lo.store(lo, std::memory_order_relaxed);
+            uint64_t carry = lo < sum.lo;
+            if (sum.hi + carry) {
+                sum_hi.store(sum_hi.load(std::memory_order_relaxed) + sum.hi + carry, std::memory_order_relaxed);
+            }
+            messages.store(messages.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            seq.store(s + 2, std::memory_order_release);
+        }
+
+        void raise(uint64_t v) {
+            uint32_t index;
+            uint8_t rank;
+            skt::hll_slot(skt::hash(v), index, rank);
+            if (rank > registers[index].load(std::memory_order_relaxed)) {
+                registers[index].store(rank, std::memory_order_relaxed);
+            }
+        }
+
+        std::atomic<uint64_t> seq{ 0 };
+        std::atomic<uint64_t> sum_lo{ 0 };
+        std::atomic<uint64_t> sum_hi{ 0 };
+        std::atomic<uint64_t> messages{ 0 };
+        std::array<std::atomic<uint8_t>, skt::HLL_REGISTERS> registers;
+    };
+
+    //partials outlive their threads, the totals cover the whole run of the process
+    class registry final {
+        registry() {
+            mtr::registry::instance().add_collector([this](std::ostream& os) { write(os); });
+        }
+    public:
+        registry(const registry&) = delete;
+        registry(registry&&) = delete;
+        registry& operator=(const registry&) = delete;
+        registry& operator= (registry&&) = delete;
+
+        static registry& instance() {
+            static registry reg;
+            return reg;
+        }
+
+        std::shared_ptr<partial> make_partial() {
+            auto p = std::make_shared<partial>();
+            const std::lock_guard<std::mutex> lock_mutex(mtx);
+            partials.push_back(p);
+            return p;
+        }
+
+        summary collect() {
+            summary s;
+            skt::hll distinct;
+            {
+                const std::lock_guard<std::mutex> lock_mutex(mtx);
+                for (auto& p : partials) {
+                    p->merge_into(s, distinct);
+                }
+                s.partials = partials.size();
+            }
+            s.mean = s.messages ? s.sum.divide(s.messages) : 0;
+            s.distinct = static_cast<uint64_t>(distinct.estimate() + 0.5);
+            return s;
+        }
+
+        //prometheus text of the merged totals
+        void write(std::ostream& os) {
+            summary s = collect();
+            os << "# HELP srv_global_values_total Values received over every connection\n";
+            os << "# TYPE srv_global_values_total counter\n";
+            os << "srv_global_values_total " << s.messages << '\n';
+            os << "# HELP srv_global_values_sum Sum of the values received over every connection\n";
+            os << "# TYPE srv_global_values_sum counter\n";
+            os << "srv_global_values_sum ";
+            if (s.sum.hi == 0) {
+                os << s.sum.lo << '\n';
+            }
+            else {
+                os << std::setprecision(17) << static_cast<double>(s.sum.hi) * 18446744073709551616.0 + static_cast<double>(s.sum.lo) << '\n';
+            }
+            os << "# HELP srv_global_values_mean Mean of the values received over every connection\n";
+            os << "# TYPE srv_global_values_mean gauge\n";
+            os << "srv_global_values_mean " << s.mean << '\n';
+            os << "# HELP srv_global_distinct_values Estimated distinct values over every connection\n";
+            os << "# TYPE srv_global_distinct_values gauge\n";
+            os << "srv_global_distinct_values " << s.distinct << '\n';
+        }
+    private:
+        std::mutex mtx;
+        std::vector<std::shared_ptr<partial>> partials;
+    };
+}
+
+#define GLOBAL_STATS gst::registry::instance()
@@ -0,0 +1,291 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include "logger.h"
+
+namespace handoff {
+
+    //hot restart: the running server passes its listening socket, live connections and storage
+    //to a successor process over a unix socket, file descriptors travel as SCM_RIGHTS
+    constexpr uint32_t HANDOFF_MAGIC = 0x48455344;           //changes with the layout of the messages
+    constexpr size_t FDS_PER_MSG = 64;
+    constexpr size_t ENTRY_WORDS = 4;                       //number, replies due, partial size, partial bytes
+    constexpr uint32_t ANSWER_TIMEOUT_MS = 5000;            //a successor that stays silent longer failed the handoff
+    constexpr uint32_t HAS_METRICS = 1;         //header flag, the metrics listener follows the connection listener
+
+    //replies already owed to a client travel with its socket so the successor sends them, so do the first
+    //bytes of a number the handoff cut in two, the successor's first read completes it
+    struct connection_entry {
+        uint32_t number;
+        uint32_t replies_due;
+        int fd;
+        uint32_t partial_size{ 0 };
+        uint8_t partial[sizeof(uint32_t)]{};
+    };
+
+    struct state {
+        int listen_fd{ -1 };
+        int metrics_fd{ -1 };                   //listener of the metrics exporter, -1 when it runs none
+        uint32_t next_number{ 0 };
+        std::vector<connection_entry> connections;
+        std::vector<uint8_t> storage;
+    };
+#ifndef _WIN32
+
+    struct header {
+        uint32_t magic;
+        uint32_t next_number;
+        uint32_t connections;
+        uint32_t flags;
+        uint64_t storage_size;
+    };
+
+    inline bool write_all(int sock, const void* data, size_t sz) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (sz) {
+            ssize_t n = ::send(sock, p, sz, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            sz -= n;
+        }
+        return true;
+    }
+
+    inline bool read_all(int sock, void* data, size_t sz) {
+        uint8_t* p = static_cast<uint8_t*>(data);
+        while (sz) {
+            ssize_t n = ::recv(sock, p, sz, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            p += n;
+            sz -= n;
+        }
+        return true;
+    }
+
+    inline bool send_with_fds(int sock, const void* data, size_t sz, const int* fds, size_t nfds) {
+        std::vector<uint8_t> control(CMSG_SPACE(sizeof(int) * nfds));
+        iovec iov{ const_cast<void*>(data), sz };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+        ssize_t n;
+        do {
+            n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            return false;
+        }
+        return static_cast<size_t>(n) == sz || write_all(sock, static_cast<const uint8_t*>(data) + n, sz - n);
+    }
+
+    inline bool recv_with_fds(int sock, void* data, size_t sz, std::vector<int>& fds, size_t nfds) {
+        std::vector<uint8_t> control(CMSG_SPACE(sizeof(int) * nfds));
+        iovec iov{ data, sz };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        ssize_t n;
+        do {
+            n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            return false;
+        }
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+                fds.insert(fds.end(), received, received + count);
+            }
+        }
+        return static_cast<size_t>(n) == sz || read_all(sock, static_cast<uint8_t*>(data) + n, sz - n);
+    }
+
+    //old process side, the successor has to answer the magic before anything is released for it,
+    //its later answers are awaited no longer than ANSWER_TIMEOUT_MS either
+    inline bool offer(int sock) {
+        timeval tv{ ANSWER_TIMEOUT_MS / 1000, (ANSWER_TIMEOUT_MS % 1000) * 1000 };
+        if (::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0) {
+            log_write->warn("handoff::offer SO_RCVTIMEO error:{}", errno);
+        }
+        uint32_t magic{ HANDOFF_MAGIC };
+        uint32_t answer{};
+        return write_all(sock, &magic, sizeof(magic)) && read_all(sock, &answer, sizeof(answer)) && answer == HANDOFF_MAGIC;
+    }
+
+    //old process side, descriptors stay owned by the caller
+    inline bool send_state(int sock, const state& st) {
+        header hdr{ HANDOFF_MAGIC, st.next_number, static_cast<uint32_t>(st.connections.size()), st.metrics_fd >= 0 ? HAS_METRICS : 0, st.storage.size() };
+        const int listeners[] = { st.listen_fd, st.metrics_fd };
+        if (!send_with_fds(sock, &hdr, sizeof(hdr), listeners, st.metrics_fd >= 0 ? 2 : 1)) {
+            return false;
+        }
+        if (!write_all(sock, st.storage.data(), st.storage.size())) {
+            return false;
+        }
+        for (size_t first = 0; first < st.connections.size(); first += FDS_PER_MSG) {
+            size_t n = std::min(FDS_PER_MSG, st.connections.size() - first);
+            std::vector<uint32_t> ids(n * ENTRY_WORDS);
+            std::vector<int> fds(n);
+            for (size_t i = 0; i < n; ++i) {
+                const auto& entry = st.connections[first + i];
+                ids[i * ENTRY_WORDS] = entry.number;
+                ids[i * ENTRY_WORDS + 1] = entry.replies_due;
+                ids[i * ENTRY_WORDS + 2] = entry.partial_size;
+                memcpy(&ids[i * ENTRY_WORDS + 3], entry.partial, sizeof(entry.partial));
+                fds[i] = entry.fd;
+            }
+            if (!send_with_fds(sock, ids.data(), ids.size() * sizeof(uint32_t), fds.data(), fds.size())) {
+                return false;
+            }
+        }
+        uint8_t ack{};
+        return read_all(sock, &ack, sizeof(ack));
+    }
+
+    //new process side, connects to the running server and takes its state over
+    inline std::unique_ptr<state> receive(const std::string& path) {
+        int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        if (sock < 0 || ::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            log_write->error("handoff::receive connect {} error:{} message:{}", path, errno, strerror(errno));
+            if (sock >= 0) {
+                ::close(sock);
+            }
+            return nullptr;
+        }
+        uint32_t magic{};
+        if (!read_all(sock, &magic, sizeof(magic)) || magic != HANDOFF_MAGIC || !write_all(sock, &magic, sizeof(magic))) {
+            log_write->error("handoff::receive {} made no offer this process understands", path);
+            ::close(sock);
+            return nullptr;
+        }
+        auto st = std::make_unique<state>();
+        header hdr{};
+        std::vector<int> fds;
+        bool ok = recv_with_fds(sock, &hdr, sizeof(hdr), fds, 2) && hdr.magic == HANDOFF_MAGIC && fds.size() == ((hdr.flags & HAS_METRICS) ? 2u : 1u);
+        if (!ok) {
+            for (int fd : fds) {
+                ::close(fd);
+            }
+        }
+        else {
+            st->listen_fd = fds[0];
+            st->metrics_fd = fds.size() > 1 ? fds[1] : -1;
+            st->next_number = hdr.next_number;
+            st->storage.resize(hdr.storage_size);
+            ok = read_all(sock, st->storage.data(), st->storage.size());
+        }
+        while (ok && st->connections.size() < hdr.connections) {
+            size_t n = std::min<size_t>(FDS_PER_MSG, hdr.connections - st->connections.size());
+            std::vector<uint32_t> ids(n * ENTRY_WORDS);
+            fds.clear();
+            ok = recv_with_fds(sock, ids.data(), ids.size() * sizeof(uint32_t), fds, n) && fds.size() == n;
+            for (size_t i = 0; ok && i < n; ++i) {
+                connection_entry entry{ ids[i * ENTRY_WORDS], ids[i * ENTRY_WORDS + 1], fds[i] };
+                entry.partial_size = std::min<uint32_t>(ids[i * ENTRY_WORDS + 2], sizeof(entry.partial));
+                memcpy(entry.partial, &ids[i * ENTRY_WORDS + 3], sizeof(entry.partial));
+                st->connections.push_back(entry);
+            }
+        }
+        uint8_t ack{ 1 };
+        ok = ok && write_all(sock, &ack, sizeof(ack));
+        ::close(sock);
+        if (!ok) {
+            log_write->error("handoff::receive incomplete state from {}", path);
+            if (st->listen_fd >= 0) {
+                ::close(st->listen_fd);
+            }
+            if (st->metrics_fd >= 0) {
+                ::close(st->metrics_fd);
+            }
+            for (auto& conn : st->connections) {
+                ::close(conn.fd);
+            }
+            return nullptr;
+        }
+        log_write->info("handoff::receive took over {} connections, {} storage bytes, next connection number {}", st->connections.size(), st->storage.size(), st->next_number);
+        return st;
+    }
+
+    //waits for a successor on a unix socket path, each accepted successor is passed to on_successor as a raw fd
+    class listener final {
+    public:
+        listener(boost::asio::io_context& io_context, const std::string& path_, std::function<void(int)> on_successor_)
+            : path(path_), acceptor_(io_context), socket_(io_context), on_successor(std::move(on_successor_)) {
+            ::unlink(path.c_str());
+            boost::asio::local::stream_protocol::endpoint ep(path);
+            acceptor_.open(ep.protocol());
+            acceptor_.bind(ep);
+            acceptor_.listen();
+            log_write->info("handoff::listener waiting for successor on {}", path);
+            start_accept();
+        }
+
+        //the handoff failed and the process serves on, the next successor is accepted
+        void listen_again() {
+            boost::asio::post(acceptor_.get_executor(), [this] {
+                start_accept();
+            });
+        }
+    private:
+        void start_accept() {
+            acceptor_.async_accept(socket_, boost::bind(&listener::handle_accept, this, boost::asio::placeholders::error));
+        }
+
+        void handle_accept(const boost::system::error_code& error) {
+            if (error) {
+                return;
+            }
+            log_write->info("handoff::listener successor connected");
+            int fd = ::dup(socket_.native_handle());
+            boost::system::error_code ec;
+            socket_.close(ec);
+            on_successor(fd);                   //one successor at a time, the next one waits for listen_again
+        }
+    private:
+        std::string path;
+        boost::asio::local::stream_protocol::acceptor acceptor_;
+        boost::asio::local::stream_protocol::socket socket_;
+        std::function<void(int)> on_successor;
+    };
+#endif
+}
@@ -0,0 +1,187 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HST_SSE2 1
+#endif
+
+namespace hst {
+
+    constexpr uint32_t DEFAULT_LOW = 0;
+    constexpr uint32_t DEFAULT_HIGH = 1024;         //the client sends numbers in 0..1023
+    constexpr uint32_t DEFAULT_WIDTH = 32;
+    constexpr uint32_t LANES = 4;                   //every lane of a batch counts into its own copy of the buckets
+    constexpr uint32_t PENDING = 16;                //numbers a connection collects before a batch update
+
+    //sorted bucket boundaries shared by every connection, bin 0 holds numbers below the first boundary,
+    //bin i numbers in [bounds[i - 1], bounds[i]) and the last bin numbers from the last boundary on,
+    //evenly spaced boundaries a power of two apart get their bins from a subtract and a shift
+    class layout final {
+    public:
+        layout() : layout(linear(DEFAULT_LOW, DEFAULT_HIGH, DEFAULT_WIDTH)) {}
+
+        explicit layout(std::vector<uint32_t> bounds_) : bounds(std::move(bounds_)) {
+            std::sort(bounds.begin(), bounds.end());
+            bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+            if (bounds.empty()) {
+                bounds.push_back(0);
+            }
+            uint32_t width = bounds.size() > 1 ? bounds[1] - bounds[0] : 0;
+            uniform = width != 0 && (width & (width - 1)) == 0;
+            for (size_t i = 1; i < bounds.size() && uniform; ++i) {
+                uniform = bounds[i] - bounds[i - 1] == width;
+            }
+            while (uniform && (1u << shift) < width) {
+                ++shift;
+            }
+        }
+
+        static std::vector<uint32_t> linear(uint32_t low, uint32_t high, uint32_t width) {
+            std::vector<uint32_t> b;
+            for (uint64_t v = low; v <= high; v += std::max<uint32_t>(width, 1)) {
+                b.push_back(static_cast<uint32_t>(v));
+            }
+            return b;
+        }
+
+        //"0,10,100,1000" boundaries, or "low:high:width" for evenly spaced ones
+        static layout parse(const std::string& text) {
+            std::vector<uint32_t> b;
+            if (text.find(':') != std::string::npos) {
+                std::istringstream in(text);
+                std::string low, high, width;
+                std::getline(in, low, ':');
+                std::getline(in, high, ':');
+                std::getline(in, width, ':');
+                b = linear(static_cast<uint32_t>(std::stoul(low)), static_cast<uint32_t>(std::stoul(high)), static_cast<uint32_t>(std::stoul(width)));
+            }
+            else {
+                std::istringstream in(text);
+                std::string bound;
+                while (std::getline(in, bound, ',')) {
+                    b.push_back(static_cast<uint32_t>(std::stoul(bound)));
+                }
+            }
+            return layout(std::move(b));
+        }
+
+        size_t bins() const {
+            return bounds.size() + 1;
+        }
+
+        const std::vector<uint32_t>& boundaries() const {
+            return bounds;
+        }
+
+        uint32_t bin(uint32_t v) const {
+            if (uniform) {
+                if (v < bounds[0]) {
+                    return 0;
+                }
+                uint32_t step = (v - bounds[0]) >> shift;
+                return step >= bounds.size() - 1 ? static_cast<uint32_t>(bounds.size()) : step + 1;
+            }
+            return static_cast<uint32_t>(std::upper_bound(bounds.begin(), bounds.end(), v) - bounds.begin());
+        }
+
+        //bins of n numbers, four at a time where SSE2 is there
+        void bins(const uint32_t* v, size_t n, uint32_t* out) const {
+            size_t i{ 0 };
+#ifdef HST_SSE2
+            if (uniform) {
+                const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+                const __m128i low = _mm_set1_epi32(static_cast<int>(bounds[0]));
+                const __m128i low_biased = _mm_xor_si128(low, bias);
+                const __m128i steps_biased = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(bounds.size() - 1)), bias);
+                const __m128i top = _mm_set1_epi32(static_cast<int>(bounds.size()));
+                const __m128i one = _mm_set1_epi32(1);
+                const __m128i count = _mm_cvtsi32_si128(static_cast<int>(shift));
+                for (; i + 4 <= n; i += 4) {
+                    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i));
+                    __m128i below = _mm_cmpgt_epi32(low_biased, _mm_xor_si128(x, bias));
+                    __m128i step = _mm_srl_epi32(_mm_sub_epi32(x, low), count);
+                    __m128i inside = _mm_cmpgt_epi32(steps_biased, _mm_xor_si128(step, bias));
+                    __m128i b = _mm_or_si128(_mm_and_si128(inside, _mm_add_epi32(step, one)), _mm_andnot_si128(inside, top));
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_andnot_si128(below, b));
+                }
+            }
+#endif
+            for (; i < n; ++i) {
+                out[i] = bin(v[i]);
+            }
+        }
+    private:
+        std::vector<uint32_t> bounds;
+        bool uniform{ false };
+        uint32_t shift{ 0 };
+    };
+
+    //counts of one connection's numbers per bin, numbers wait in a small buffer and are binned
+    //a batch at a time, the counts are spread over LANES copies so neighbouring equal bins don't stall
+    //on the same counter, a query folds the lanes, the layout is a copy so the histogram outlives whatever it came from
+    class value_histogram final {
+    public:
+        explicit value_histogram(const layout& l_) : l(l_), counts(new uint64_t[LANES * l_.bins()]()) {}
+        value_histogram(const value_histogram&) = delete;
+        value_histogram& operator=(const value_histogram&) = delete;
+
+        void add(uint32_t v) {
+            pending[pending_count++] = v;
+            if (pending_count == PENDING) {
+                flush();
+            }
+        }
+
+        void add(const uint32_t* v, size_t n) {
+            uint32_t bin[PENDING];
+            size_t bins = l.bins();
+            while (n) {
+                size_t batch = std::min<size_t>(n, PENDING);
+                l.bins(v, batch, bin);
+                for (size_t i = 0; i < batch; ++i) {
+                    ++counts[(i % LANES) * bins + bin[i]];
+                }
+                v += batch;
+                n -= batch;
+            }
+        }
+
+        //one count per bin of the layout
+        void snapshot(std::vector<uint64_t>& out) {
+            flush();
+            size_t bins = l.bins();
+            out.assign(bins, 0);
+            for (uint32_t lane = 0; lane < LANES; ++lane) {
+                for (size_t b = 0; b < bins; ++b) {
+                    out[b] += counts[lane * bins + b];
+                }
+            }
+        }
+
+        //counts of a snapshot taken with the same layout go into the first lane
+        void load(const std::vector<uint64_t>& in) {
+            for (size_t b = 0; b < std::min(in.size(), l.bins()); ++b) {
+                counts[b] += in[b];
+            }
+        }
+
+        size_t memory() const {
+            return sizeof(value_histogram) + LANES * l.bins() * sizeof(uint64_t) + l.boundaries().size() * sizeof(uint32_t);
+        }
+    private:
+        void flush() {
+            add(pending, pending_count);
+            pending_count = 0;
+        }
+
+        const layout l;
+        std::unique_ptr<uint64_t[]> counts;
+        uint32_t pending[PENDING];
+        uint32_t pending_count{ 0 };
+    };
+}
@@ -20,7 +20,7 @@ namespace _log{
         }
         void init(const std::string& filename_log) {
             spdlog::init_thread_pool(8192, 1);
-            auto stdout_sink = std::make_shared<spdlog::sinks::wincolor_stdout_sink_mt>();
+            auto stdout_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
             stdout_sink->set_level(spdlog::level::info);
             stdout_sink->set_pattern("%D %H:%M:%S.%e %05t %05l %v");
             auto rotating_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(filename_log, 1024 * 1024 * 10, 3);
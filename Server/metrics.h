@@ -0,0 +1,430 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include "logger.h"
+
+namespace mtr {
+
+    using boost::asio::ip::tcp;
+
+    constexpr size_t SLOT_CHUNK = 512;             //slots a thread's shard allocates at a time
+    constexpr size_t MAX_CHUNKS = 64;
+    constexpr size_t MAX_SLOTS = SLOT_CHUNK * MAX_CHUNKS;
+    constexpr size_t MAX_GAUGES = 64;
+    constexpr uint16_t DEFAULT_METRICS_PORT = 9464;
+    constexpr size_t MAX_REQUEST_BYTES = 8192;      //a scrape request without its blank line within this is dropped
+
+    enum class metric_type : uint8_t {
+        COUNTER,
+        GAUGE,
+        HISTOGRAM
+    };
+
+    class registry;
+
+    //handles are cheap to copy, hot path touches only the thread local shard
+    class counter {
+    public:
+        counter() = default;
+        explicit counter(size_t slot_) : slot(slot_) {}
+        void inc(uint64_t n = 1) const;
+    private:
+        size_t slot{};
+    };
+
+    class gauge {
+    public:
+        gauge() = default;
+        explicit gauge(std::atomic<int64_t>* value_) : value(value_) {}
+        void set(int64_t v) const { value->store(v, std::memory_order_relaxed); }
+        void add(int64_t v) const { value->fetch_add(v, std::memory_order_relaxed); }
+    private:
+        std::atomic<int64_t>* value{};
+    };
+
+    class histogram {
+    public:
+        histogram() = default;
+        histogram(size_t slot_, const std::vector<uint64_t>* bounds_) : slot(slot_), bounds(bounds_) {}
+        void observe(uint64_t v) const;         //no-op on a handle that was never registered
+    private:
+        size_t slot{};
+        const std::vector<uint64_t>* bounds{};
+    };
+
+    class registry final {
+        //one shard per thread, written only by its owner, summed on scrape, the owner allocates a chunk of
+        //slots on its first write there, so the registry grows without moving a slot under a reader
+        struct shard {
+            shard() {
+                for (auto& c : chunks) {
+                    c.store(nullptr, std::memory_order_relaxed);
+                }
+            }
+            ~shard() {
+                for (auto& c : chunks) {
+                    delete[] c.load(std::memory_order_relaxed);
+                }
+            }
+            shard(const shard&) = delete;
+            shard& operator=(const shard&) = delete;
+
+            std::atomic<uint64_t>& slot(size_t i) {
+                auto& c = chunks[i / SLOT_CHUNK];
+                std::atomic<uint64_t>* p = c.load(std::memory_order_relaxed);
+                if (p == nullptr) {
+                    p = new std::atomic<uint64_t>[SLOT_CHUNK];
+                    for (size_t j = 0; j < SLOT_CHUNK; ++j) {
+                        p[j].store(0, std::memory_order_relaxed);
+                    }
+                    c.store(p, std::memory_order_release);
+                }
+                return p[i % SLOT_CHUNK];
+            }
+
+            uint64_t read(size_t i) const {
+                const std::atomic<uint64_t>* p = chunks[i / SLOT_CHUNK].load(std::memory_order_acquire);
+                return p ? p[i % SLOT_CHUNK].load(std::memory_order_relaxed) : 0;
+            }
+
+            std::array<std::atomic<std::atomic<uint64_t>*>, MAX_CHUNKS> chunks;
+        };
+
+        struct descriptor {
+            std::string name;
+            std::string help;
+            metric_type type;
+            size_t slot;
+            std::unique_ptr<std::vector<uint64_t>> bounds;
+            std::string label;                  //name="value" of one member of a family sharing the metric name
+        };
+        registry() {
+            for (auto& g : gauges) {
+                g.store(0, std::memory_order_relaxed);
+            }
+        }
+    public:
+        registry(const registry&) = delete;
+        registry(registry&&) = delete;
+        registry& operator=(const registry&) = delete;
+        registry& operator= (registry&&) = delete;
+
+        static registry& instance() {
+            static registry reg;
+            return reg;
+        }
+
+        counter make_counter(const std::string& name, const std::string& help) {
+            const std::lock_guard<std::mutex> lock_mutex(mtx);
+            size_t slot = reserve_slots(1);
+            descs.push_back(descriptor{ name, help, metric_type::COUNTER, slot, nullptr, {} });
+            return counter(slot);
+        }
+
+        gauge make_gauge(const std::string& name, const std::string& help) {
+            const std::lock_guard<std::mutex> lock_mutex(mtx);
+            if (next_gauge >= MAX_GAUGES) {
+                throw std::length_error("mtr::registry: gauges exhausted");
+            }
+            size_t slot = next_gauge++;
+            descs.push_back(descriptor{ name, help, metric_type::GAUGE, slot, nullptr, {} });
+            return gauge(&gauges[slot]);
+        }
+
+        //bounds are upper inclusive limits of buckets, +Inf bucket and sum are added,
+        //histograms made with the same name and different labels like loop="io" are scraped as one family
+        histogram make_histogram(const std::string& name, const std::string& help, std::vector<uint64_t> bounds, const std::string& label = {}) {
+            const std::lock_guard<std::mutex> lock_mutex(mtx);
+            std::sort(bounds.begin(), bounds.end());
+            size_t slot = reserve_slots(bounds.size() + 2);
+            descs.push_back(descriptor{ name, help, metric_type::HISTOGRAM, slot, std::make_unique<std::vector<uint64_t>>(std::move(bounds)), label });
+            return histogram(slot, descs.back().bounds.get());
+        }
+
+        //writes metrics kept outside the registry at the end of every scrape
+        void add_collector(std::function<void(std::ostream&)> collector) {
+            const std::lock_guard<std::mutex> lock_mutex(mtx);
+            collectors.push_back(std::move(collector));
+        }
+
+        void add(size_t slot, uint64_t n) {
+            auto& s = local().slot(slot);
+            s.store(s.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        std::string scrape() {
+            const std::lock_guard<std::mutex> lock_mutex(mtx);
+            std::ostringstream os;
+            auto sum_slot = [&](size_t slot) {
+                uint64_t v{};
+                for (auto& sh : shards) {
+                    v += sh->read(slot);
+                }
+                return v;
+            };
+            std::vector<bool> written(descs.size());
+            for (size_t i = 0; i < descs.size(); ++i) {
+                if (written[i]) {
+                    continue;
+                }
+                os << "# HELP " << descs[i].name << ' ' << descs[i].help << '\n';
+                os << "# TYPE " << descs[i].name << ' ' << type_name(descs[i].type) << '\n';
+                for (size_t j = i; j < descs.size(); ++j) {         //members of a family follow one header
+                    if (!written[j] && descs[j].name == descs[i].name) {
+                        written[j] = true;
+                        write_samples(os, descs[j], sum_slot);
+                    }
+                }
+            }
+            for (auto& collector : collectors) {
+                collector(os);
+            }
+            return os.str();
+        }
+
+    private:
+        static const char* type_name(metric_type type) {
+            switch (type) {
+            case metric_type::COUNTER:
+                return "counter";
+            case metric_type::GAUGE:
+                return "gauge";
+            default:
+                return "histogram";
+            }
+        }
+
+        template<class SumSlot>
+        void write_samples(std::ostream& os, const descriptor& d, SumSlot& sum_slot) {
+            std::string labels = d.label.empty() ? std::string() : "{" + d.label + "}";
+            std::string bucket_prefix = d.label.empty() ? std::string("{") : "{" + d.label + ",";
+            switch (d.type) {
+            case metric_type::COUNTER:
+                os << d.name << labels << ' ' << sum_slot(d.slot) << '\n';
+                break;
+            case metric_type::GAUGE:
+                os << d.name << labels << ' ' << gauges[d.slot].load(std::memory_order_relaxed) << '\n';
+                break;
+            case metric_type::HISTOGRAM: {
+                uint64_t cumulative{};
+                for (size_t i = 0; i < d.bounds->size(); ++i) {
+                    cumulative += sum_slot(d.slot + i);
+                    os << d.name << "_bucket" << bucket_prefix << "le=\"" << (*d.bounds)[i] << "\"} " << cumulative << '\n';
+                }
+                cumulative += sum_slot(d.slot + d.bounds->size());
+                os << d.name << "_bucket" << bucket_prefix << "le=\"+Inf\"} " << cumulative << '\n';
+                os << d.name << "_sum" << labels << ' ' << sum_slot(d.slot + d.bounds->size() + 1) << '\n';
+                os << d.name << "_count" << labels << ' ' << cumulative << '\n';
+                break;
+            }
+            }
+        }
+
+        size_t reserve_slots(size_t n) {
+            if (next_slot + n > MAX_SLOTS) {
+                throw std::length_error("mtr::registry: slots exhausted");
+            }
+            size_t slot = next_slot;
+            next_slot += n;
+            return slot;
+        }
+
+        shard& local() {
+            thread_local shard* sh = nullptr;
+            if (sh == nullptr) {
+                auto new_shard = std::make_unique<shard>();
+                sh = new_shard.get();
+                const std::lock_guard<std::mutex> lock_mutex(mtx);
+                shards.push_back(std::move(new_shard));
+            }
+            return *sh;
+        }
+
+    private:
+        std::mutex mtx;
+        std::vector<std::unique_ptr<shard>> shards;
+        std::vector<descriptor> descs;
+        std::vector<std::function<void(std::ostream&)>> collectors;
+        std::array<std::atomic<int64_t>, MAX_GAUGES> gauges;
+        size_t next_slot{ 0 };
+        size_t next_gauge{ 0 };
+    };
+
+    inline void counter::inc(uint64_t n) const {
+        registry::instance().add(slot, n);
+    }
+
+    inline void histogram::observe(uint64_t v) const {
+        if (bounds == nullptr) {
+            return;
+        }
+        size_t idx = std::lower_bound(bounds->begin(), bounds->end(), v) - bounds->begin();
+        registry::instance().add(slot + idx, 1);
+        registry::instance().add(slot + bounds->size() + 1, v);
+    }
+
+    class server_metrics final {
+        server_metrics() {
+            auto& reg = registry::instance();
+            connections_accepted = reg.make_counter("srv_connections_accepted_total", "Accepted client connections");
+            connections_closed = reg.make_counter("srv_connections_closed_total", "Closed client connections");
+            messages_in = reg.make_counter("srv_messages_in_total", "Numbers received from clients");
+            messages_out = reg.make_counter("srv_messages_out_total", "Replies sent to clients");
+            bytes_in = reg.make_counter("srv_bytes_in_total", "Bytes received from clients");
+            bytes_out = reg.make_counter("srv_bytes_out_total", "Bytes sent to clients");
+            dump_cycles = reg.make_counter("srv_dump_cycles_total", "Dump cycles written by dump_writer");
+            dump_bytes = reg.make_counter("srv_dump_bytes_total", "Bytes written to dump files");
+            udp_datagrams = reg.make_counter("srv_udp_datagrams_total", "Datagrams accepted by udp ingest");
+            udp_dropped = reg.make_counter("srv_udp_dropped_total", "Malformed, truncated or overflowing datagrams dropped by udp ingest");
+            dump_cycle_ms = reg.make_histogram("srv_dump_cycle_ms", "Duration of a dump cycle in milliseconds", { 1, 5, 10, 50, 100, 500, 1000, 5000 });
+            connections_active = reg.make_gauge("srv_connections_active", "Connections served by client_io");
+            client_queue_depth = reg.make_gauge("srv_client_queue_depth", "Depth of the accepted connections queue");
+            dump_queue_depth = reg.make_gauge("srv_dump_queue_depth", "Depth of the dump_writer queue");
+            storage_connections = reg.make_gauge("srv_storage_connections", "Connections held in storage_numbers");
+            storage_values = reg.make_gauge("srv_storage_values", "Distinct values held in storage_numbers");
+            storage_arena_bytes = reg.make_gauge("srv_storage_arena_bytes", "Bytes of the per connection storage arenas");
+            storage_bytes = reg.make_gauge("srv_storage_bytes", "Bytes accounted to stored connections, checked against the budget");
+            storage_retained = reg.make_gauge("srv_storage_retained", "Closed connections kept in storage for a resume");
+            storage_approx_connections = reg.make_gauge("srv_storage_approx_connections", "Connections whose values are kept as a sketch");
+            storage_evictions = reg.make_counter("srv_storage_evictions_total", "Closed connections evicted from storage");
+            storage_resumes = reg.make_counter("srv_storage_resumes_total", "Retained connections that got numbers again");
+        }
+    public:
+        server_metrics(const server_metrics&) = delete;
+        server_metrics(server_metrics&&) = delete;
+        server_metrics& operator=(const server_metrics&) = delete;
+        server_metrics& operator= (server_metrics&&) = delete;
+
+        static server_metrics& instance() {
+            static server_metrics smetrics;
+            return smetrics;
+        }
+
+        counter connections_accepted;
+        counter connections_closed;
+        counter messages_in;
+        counter messages_out;
+        counter bytes_in;
+        counter bytes_out;
+        counter dump_cycles;
+        counter dump_bytes;
+        counter udp_datagrams;
+        counter udp_dropped;
+        histogram dump_cycle_ms;
+        gauge connections_active;
+        gauge client_queue_depth;
+        gauge dump_queue_depth;
+        gauge storage_connections;
+        gauge storage_values;
+        gauge storage_arena_bytes;
+        gauge storage_bytes;
+        gauge storage_retained;
+        gauge storage_approx_connections;
+        counter storage_evictions;
+        counter storage_resumes;
+    };
+
+    //minimal HTTP/1.0 endpoint, answers GET /metrics on localhost only
+    class http_exporter final {
+        class session : public boost::enable_shared_from_this<session> {
+        public:
+            using pointer = boost::shared_ptr<session>;
+            explicit session(boost::asio::io_context& io_context) : socket_(io_context), request_(MAX_REQUEST_BYTES) {}
+
+            tcp::socket& socket() {
+                return socket_;
+            }
+
+            void start() {
+                boost::asio::async_read_until(socket_, request_, "\r\n\r\n",
+                    boost::bind(&session::handle_read, shared_from_this(),
+                        boost::asio::placeholders::error));
+            }
+        private:
+            void handle_read(const boost::system::error_code& error) {
+                if (error) {
+                    return;
+                }
+                std::istream is(&request_);
+                std::string method, path;
+                is >> method >> path;
+                if (method == "GET" && (path == "/metrics" || path == "/")) {
+                    std::string body = registry::instance().scrape();
+                    response_ = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                        + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+                }
+                else {
+                    response_ = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                }
+                boost::asio::async_write(socket_, boost::asio::buffer(response_),
+                    boost::bind(&session::handle_write, shared_from_this(),
+                        boost::asio::placeholders::error));
+            }
+
+            void handle_write(const boost::system::error_code& error) {
+                if (error && error != boost::asio::error::operation_aborted) {
+                    log_write->warn("http_exporter: response not sent: {}", error.message());
+                }
+                boost::system::error_code ec;
+                socket_.shutdown(tcp::socket::shutdown_both, ec);
+                socket_.close(ec);
+            }
+        private:
+            tcp::socket socket_;
+            boost::asio::streambuf request_;
+            std::string response_;
+        };
+    public:
+        http_exporter(boost::asio::io_context& io_context, uint16_t port)
+            : io_context_(io_context),
+            acceptor_(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port))
+        {
+            log_write->info("http_exporter: metrics available on 127.0.0.1:{}/metrics", port);
+            start_accept();
+        }
+
+        //serves on a listening socket a predecessor process handed over
+        http_exporter(boost::asio::io_context& io_context, int listen_fd)
+            : io_context_(io_context), acceptor_(io_context, tcp::v4(), listen_fd)
+        {
+            log_write->info("http_exporter: metrics listener taken over on port {}", acceptor_.local_endpoint().port());
+            start_accept();
+        }
+
+        int native_handle() {
+            return acceptor_.native_handle();
+        }
+    private:
+        void start_accept() {
+            session::pointer new_session = boost::shared_ptr<session>(new session(io_context_));
+            acceptor_.async_accept(new_session->socket(),
+                boost::bind(&http_exporter::handle_accept, this, new_session,
+                    boost::asio::placeholders::error));
+        }
+
+        void handle_accept(session::pointer new_session, const boost::system::error_code& error) {
+            if (!error) {
+                new_session->start();
+            }
+            else if (error == boost::asio::error::operation_aborted) {
+                return;
+            }
+            start_accept();
+        }
+    private:
+        boost::asio::io_context& io_context_;
+        tcp::acceptor acceptor_;
+    };
+}
+#define METRICS mtr::server_metrics::instance()
@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <linux/mempolicy.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "logger.h"
+#include "affinity.h"
+
+namespace numa {
+
+    constexpr const char* NODES_PATH = "/sys/devices/system/node";
+    constexpr uint32_t MAX_NODES = 64;
+
+    //"0-3,8,10-11" as written in sysfs cpulist files
+    inline std::vector<uint32_t> parse_cpulist(const std::string& list) {
+        std::vector<uint32_t> cpus;
+        std::istringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            if (range.empty() || range == "\n") {
+                continue;
+            }
+            auto dash = range.find('-');
+            uint32_t first = static_cast<uint32_t>(std::stoul(range.substr(0, dash)));
+            uint32_t last = dash == std::string::npos ? first : static_cast<uint32_t>(std::stoul(range.substr(dash + 1)));
+            for (uint32_t cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    //nodes and the cpus of each the process may run on, a machine without sysfs nodes is one node holding
+    //every allowed cpu, node and cpu ids may have gaps, so both keep the ids the kernel gave them
+    class topology final {
+        struct node_info {
+            uint32_t id;
+            std::vector<uint32_t> cpus;
+        };
+    public:
+        static const topology& instance() {
+            static topology t;
+            return t;
+        }
+
+        size_t nodes() const {
+            return node_list.size();
+        }
+
+        //index runs over the nodes that exist, id is what the kernel calls the node
+        uint32_t id(size_t index) const {
+            return node_list[index].id;
+        }
+
+        const std::vector<uint32_t>& cpus(size_t index) const {
+            return node_list[index].cpus;
+        }
+
+        //node id of a cpu, -1 for a cpu sysfs doesn't list
+        int node_of(uint32_t cpu) const {
+            for (auto& node : node_list) {
+                for (uint32_t c : node.cpus) {
+                    if (c == cpu) {
+                        return static_cast<int>(node.id);
+                    }
+                }
+            }
+            return -1;
+        }
+
+        //worker i goes to the node at index i % nodes, so consecutive workers alternate between nodes
+        uint32_t cpu_for_worker(size_t worker) const {
+            const auto& list = node_list[worker % node_list.size()].cpus;
+            return list[(worker / node_list.size()) % list.size()];
+        }
+    private:
+        topology() {
+            const auto& allowed = aff::allowed_cpus();
+            for (uint32_t node = 0; node < MAX_NODES; ++node) {
+                std::ifstream in(std::string(NODES_PATH) + "/node" + std::to_string(node) + "/cpulist");
+                if (!in) {
+                    continue;
+                }
+                std::string list;
+                std::getline(in, list);
+                try {
+                    auto cpus = parse_cpulist(list);
+                    cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&allowed](uint32_t cpu) {
+                        return !std::binary_search(allowed.begin(), allowed.end(), cpu);
+                    }), cpus.end());
+                    if (!cpus.empty()) {
+                        node_list.push_back(node_info{ node, std::move(cpus) });
+                    }
+                }
+                catch (std::exception& e) {
+                    log_write->warn("numa::topology node {} cpulist '{}' unreadable: {}", node, list, e.what());
+                }
+            }
+            if (node_list.empty()) {
+                node_list.push_back(node_info{ 0, allowed });
+            }
+            log_write->info("numa::topology {} nodes", node_list.size());
+        }
+
+        std::vector<node_info> node_list;
+    };
+
+    //memory the calling thread touches first comes from node while it has free pages
+    inline bool prefer_node(int node) {
+#ifdef __linux__
+        if (node < 0 || node >= static_cast<int>(MAX_NODES)) {
+            return false;
+        }
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, MAX_NODES + 1) != 0) {
+            log_write->warn("numa::prefer_node {} error:{} message:{}", node, errno, strerror(errno));
+            return false;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    //a SO_REUSEPORT listener marked with a cpu gets the connections whose packets that cpu handled
+    inline bool set_incoming_cpu(int fd, uint32_t cpu) {
+#if defined(__linux__) && defined(SO_INCOMING_CPU)
+        int value = static_cast<int>(cpu);
+        if (::setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &value, sizeof(value)) != 0) {
+            log_write->warn("numa::set_incoming_cpu {} error:{} message:{}", cpu, errno, strerror(errno));
+            return false;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+}
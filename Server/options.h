@@ -0,0 +1,152 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <sstream>
+#include "logger.h"
+#include "metrics.h"
+#include "endpoint.h"
+#include "window.h"
+#include "histogram.h"
+
+namespace srv {
+
+    constexpr uint16_t DEFAULT_PORT = 64000;
+    constexpr uint32_t DEFAULT_DRAIN_TIMEOUT_MS = 2000;
+    constexpr uint32_t HANDOFF_WRITE_WAIT_MS = 100;
+    constexpr uint32_t DEFAULT_BUSY_POLL_US = 50;
+    constexpr size_t DEFAULT_RETAIN_CLOSED = 1024;
+    constexpr size_t DEFAULT_STORAGE_BUDGET_MB = 1024;
+
+    enum class io_backend : uint8_t {
+        ASIO,
+        URING
+    };
+
+    struct options {
+        ept::endpoint_uri endpoint{ ept::transport::TCP, "0.0.0.0", DEFAULT_PORT, "" };
+        uint16_t metrics_port{ mtr::DEFAULT_METRICS_PORT };
+        io_backend backend{ io_backend::ASIO };
+        uint32_t drain_timeout_ms{ DEFAULT_DRAIN_TIMEOUT_MS };
+        std::string handoff_path;           //unix socket a successor connects to for a hot restart
+        bool takeover{ false };             //take state over from the server listening on handoff_path
+        std::string shm_name;               //shared memory segment served next to the socket listener
+        ept::endpoint_uri udp_endpoint;     //udp ingest next to the socket listener, off while port is 0
+        uint32_t shards{ 0 };               //thread per core mode with this many shards, off below 2
+        bool coroutines{ false };           //stream connections served by coroutines on shards, needs a C++20 build
+        bool busy_poll{ false };            //io threads spin instead of waiting
+        uint32_t busy_poll_us{ DEFAULT_BUSY_POLL_US };  //SO_BUSY_POLL of accepted sockets in busy poll mode
+        std::vector<uint32_t> cpus;         //isolated cores for the spinning threads, handed out in order
+        bool numa{ false };                 //shards spread over numa nodes with node local memory
+        size_t retain_closed{ DEFAULT_RETAIN_CLOSED };          //closed connections kept in storage, 0 keeps all
+        size_t storage_budget_mb{ DEFAULT_STORAGE_BUDGET_MB };  //storage memory closed connections are evicted for, 0 for none
+        size_t approx_threshold{ 0 };       //distinct values a connection keeps exactly before it is sketched, 0 for never
+        wnd::config window;                 //replies carry the mean of a sliding window while set
+        bool order_stats{ false };          //stored values indexed for rank and quantile queries
+        bool histograms{ false };           //per connection histograms, dumped next to the values
+        hst::layout histogram_layout;
+        uint64_t bench_storage{ 0 };        //numbers the storage benchmark ingests before the server exits, 0 serves instead
+    };
+
+    //accepts --key=value arguments, unknown or malformed ones are logged and ignored
+    inline options parse_options(int argc, char* argv[]) {
+        options opts;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg(argv[i]);
+            auto pos = arg.find('=');
+            std::string key = arg.substr(0, pos);
+            std::string value = pos == std::string::npos ? std::string() : arg.substr(pos + 1);
+            try {
+                if (key == "--port") {
+                    opts.endpoint.port = static_cast<uint16_t>(std::stoul(value));
+                }
+                else if (key == "--listen") {
+                    auto ep = ept::parse(value);        //shm and udp endpoints are served next to the socket one
+                    if (ep.kind == ept::transport::SHM) {
+                        opts.shm_name = ep.path;
+                    }
+                    else if (ep.kind == ept::transport::UDP) {
+                        opts.udp_endpoint = ep;
+                    }
+                    else {
+                        opts.endpoint = ep;
+                    }
+                }
+                else if (key == "--metrics-port") {
+                    opts.metrics_port = static_cast<uint16_t>(std::stoul(value));
+                }
+                else if (key == "--drain-timeout") {
+                    opts.drain_timeout_ms = static_cast<uint32_t>(std::stoul(value));
+                }
+                else if (key == "--handoff" && !value.empty()) {
+                    opts.handoff_path = value;
+                }
+                else if (key == "--shards") {
+                    opts.shards = value == "auto" ? std::thread::hardware_concurrency() : static_cast<uint32_t>(std::stoul(value));
+                }
+                else if (key == "--busy-poll") {
+                    opts.busy_poll = true;
+                    if (!value.empty()) {
+                        opts.busy_poll_us = static_cast<uint32_t>(std::stoul(value));
+                    }
+                }
+                else if (key == "--cpus") {
+                    std::istringstream list(value);
+                    std::string cpu;
+                    while (std::getline(list, cpu, ',')) {
+                        opts.cpus.push_back(static_cast<uint32_t>(std::stoul(cpu)));
+                    }
+                }
+                else if (key == "--retain") {
+                    opts.retain_closed = static_cast<size_t>(std::stoull(value));
+                }
+                else if (key == "--storage-budget") {
+                    opts.storage_budget_mb = static_cast<size_t>(std::stoull(value));
+                }
+                else if (key == "--approx-threshold") {
+                    opts.approx_threshold = static_cast<size_t>(std::stoull(value));
+                }
+                else if (key == "--window") {
+                    if (!wnd::parse(value, opts.window)) {
+                        log_write->warn("parse_options: window {} is not <n>s, <n>ms or <n>msg", value);
+                    }
+                }
+                else if (key == "--window-buckets") {
+                    opts.window.buckets = static_cast<uint32_t>(std::stoul(value));
+                }
+                else if (key == "--bench-storage") {
+                    opts.bench_storage = std::stoull(value);
+                }
+                else if (key == "--order-stats") {
+                    opts.order_stats = true;
+                }
+                else if (key == "--histogram") {
+                    opts.histograms = true;
+                    if (!value.empty()) {
+                        opts.histogram_layout = hst::layout::parse(value);
+                    }
+                }
+                else if (key == "--numa") {
+                    opts.numa = true;
+                }
+                else if (key == "--coro") {
+                    opts.coroutines = true;
+                }
+                else if (key == "--takeover") {
+                    opts.takeover = true;
+                }
+                else if (key == "--backend" && (value == "asio" || value == "uring")) {
+                    opts.backend = value == "uring" ? io_backend::URING : io_backend::ASIO;
+                }
+                else {
+                    log_write->warn("parse_options: unknown argument {}", arg);
+                }
+            }
+            catch (std::exception& e) {
+                log_write->warn("parse_options: bad value in {} error:{}", arg, e.what());
+            }
+        }
+        return opts;
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace ord {
+
+    constexpr size_t MIN_BUFFER = 64;
+
+    //a connection's values kept sorted for rank and quantile queries: new values go into a small sorted
+    //buffer merged into the main array once it holds sqrt of it, so an insert moves O(sqrt n) values
+    //amortized, and a query is a binary search over both arrays, O(log n), nothing is copied or sorted for it
+    class order_index final {
+    public:
+        order_index() = default;
+        order_index(const order_index&) = delete;
+        order_index& operator=(const order_index&) = delete;
+
+        void insert(uint64_t v) {
+            buffer.insert(std::upper_bound(buffer.begin(), buffer.end(), v), v);
+            if (buffer.size() >= merge_at()) {
+                merge();
+            }
+        }
+
+        size_t size() const {
+            return sorted.size() + buffer.size();
+        }
+
+        //values smaller than v
+        size_t rank(uint64_t v) const {
+            return static_cast<size_t>(std::lower_bound(sorted.begin(), sorted.end(), v) - sorted.begin()) +
+                static_cast<size_t>(std::lower_bound(buffer.begin(), buffer.end(), v) - buffer.begin());
+        }
+
+        //k-th smallest value counting from 0, k < size(), found by bisecting how many come from the buffer
+        uint64_t select(size_t k) const {
+            const std::vector<uint64_t>& a = sorted;
+            const std::vector<uint64_t>& b = buffer;
+            size_t lo = k + 1 > a.size() ? k + 1 - a.size() : 0;
+            size_t hi = std::min(k + 1, b.size());
+            while (lo < hi) {
+                size_t i = lo + (hi - lo) / 2;
+                if (b[i] < a[k - i]) {
+                    lo = i + 1;
+                }
+                else {
+                    hi = i;
+                }
+            }
+            size_t j = k + 1 - lo;
+            uint64_t from_b = lo ? b[lo - 1] : 0;
+            uint64_t from_a = j ? a[j - 1] : 0;
+            return std::max(from_a, from_b);
+        }
+
+        //nearest rank quantile, q in [0, 1], 0 for an empty index
+        uint64_t quantile(double q) const {
+            size_t n = size();
+            return n ? select(nearest_rank(q, n)) : 0;
+        }
+
+        size_t memory() const {
+            return (sorted.capacity() + buffer.capacity()) * sizeof(uint64_t);
+        }
+
+        static size_t nearest_rank(double q, size_t n) {
+            q = std::min(std::max(q, 0.0), 1.0);
+            size_t k = static_cast<size_t>(std::ceil(q * static_cast<double>(n)));
+            return k ? k - 1 : 0;
+        }
+    private:
+        size_t merge_at() const {
+            return std::max(MIN_BUFFER, static_cast<size_t>(std::sqrt(static_cast<double>(sorted.size()))));
+        }
+
+        //in place from the back: sorted grows by the buffer, its capacity doubles so a merge rarely
+        //allocates, and the largest remaining value of either array goes to the free end
+        void merge() {
+            size_t i = sorted.size();
+            size_t j = buffer.size();
+            sorted.resize(i + j);
+            for (size_t out = i + j; j;) {
+                if (i && sorted[i - 1] > buffer[j - 1]) {
+                    sorted[--out] = sorted[--i];
+                }
+                else {
+                    sorted[--out] = buffer[--j];
+                }
+            }
+            buffer.clear();
+        }
+
+        std::vector<uint64_t> sorted;
+        std::vector<uint64_t> buffer;
+    };
+}
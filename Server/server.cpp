@@ -3,21 +3,30 @@
 
 #include <iostream>
 #include <string>
-#include <conio.h>
+#include <csignal>
 #include "logger.h"
 #include "srv.h"
+#include "bench.h"
 
-int main()
+int main(int argc, char* argv[])
 {
     log_instance.init("server.log");
+    auto opts = srv::parse_options(argc, argv);
+    if (opts.bench_storage) {
+        return bnc::storage_ingest(opts.bench_storage) ? 0 : 1;   //scalar against batch ingestion, no server
+    }
     log_write->info("start server");
-    SERVER.start();
-    while (true) {
-        if (_kbhit() && _getch() == VK_ESCAPE) {
-            SERVER.stop();
-            break;
+    SERVER.start(opts);
+    boost::asio::io_context signals_context;
+    boost::asio::signal_set signals(signals_context, SIGINT, SIGTERM);
+    signals.async_wait([](const boost::system::error_code& error, int signal_number) {
+        if (error) {
+            return;                                 //wait cancelled on shutdown
         }
-    }
+        log_write->info("signal {} received, stopping server", signal_number);
+    });
+    signals_context.run();                          //blocks without spinning until SIGINT/SIGTERM
+    SERVER.stop();
     log_write->info("stop server");
     return 0;
 }
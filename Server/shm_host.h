@@ -0,0 +1,108 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include "logger.h"
+#include "shm_ring.h"
+
+namespace shm {
+
+    constexpr uint32_t MAX_BATCH = RING_SIZE;          //one poll may empty a full ring
+    constexpr uint32_t OWNER_CHECK_MS = 1000;          //how often the owners of taken slots are checked for being alive
+
+    //server side of the shared memory transport, polled by client_io, each active slot is one connection,
+    //clients map the segment writable so nothing in it but the slot states and rings is read after creation
+    class host final {
+    public:
+        explicit host(const std::string& name_) : name(name_), map(mapping::create(name_)), seg(map->get()) {
+            log_write->info("shm::host segment {} with {} slots of {} entries", name, MAX_SLOTS, RING_SIZE);
+        }
+
+        ~host() {
+            log_write->info("shm::host segment {} removed", name);
+        }
+
+        //open gives the connection number of a new client, number stores a value and returns the reply,
+        //close tells a client is gone, every callback runs on the polling thread
+        template<class Open, class Number, class Close>
+        void poll(Open&& open, Number&& number, Close&& close) {
+            auto now = std::chrono::steady_clock::now();
+            bool check_owners = now >= owner_check;
+            if (check_owners) {
+                owner_check = now + std::chrono::milliseconds(OWNER_CHECK_MS);
+            }
+            for (uint32_t i = 0; i < MAX_SLOTS; ++i) {
+                slot& s = seg->slots[i];
+                uint32_t state = s.state.load(std::memory_order_acquire);
+                if (state == FREE) {
+                    continue;
+                }
+                if (check_owners && state != CLOSING && !process_alive(s.owner.load(std::memory_order_acquire))) {
+                    reclaim(i, state, close);
+                    continue;
+                }
+                if (state == CLAIMED) {
+                    numbers[i] = open();
+                    if (!s.state.compare_exchange_strong(state, ACTIVE, std::memory_order_acq_rel)) {
+                        state = CLOSING;            //client left before the server saw it
+                    }
+                    log_write->info("shm::host slot {} connected as connection {}", i, numbers[i]);
+                }
+                uint32_t value{};
+                for (uint32_t n = 0; n < MAX_BATCH && !s.replies.full() && s.requests.pop(value); ++n) {
+                    s.replies.push(number(numbers[i], value));
+                }
+                if (state == CLOSING && s.requests.empty()) {
+                    log_write->info("shm::host slot {} connection {} closed", i, numbers[i]);
+                    close(numbers[i]);
+                    free(s);
+                }
+            }
+        }
+
+        template<class F>
+        void for_each_active(F&& f) {
+            for (uint32_t i = 0; i < MAX_SLOTS; ++i) {
+                if (seg->slots[i].state.load(std::memory_order_acquire) == ACTIVE) {
+                    f(numbers[i]);
+                }
+            }
+        }
+
+        //requests not yet answered, drain waits for them
+        bool pending() const {
+            for (uint32_t i = 0; i < MAX_SLOTS; ++i) {
+                uint32_t state = seg->slots[i].state.load(std::memory_order_acquire);
+                if (state != FREE && !seg->slots[i].requests.empty()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    private:
+        //the client died holding the slot, its requests are dropped since nobody reads their replies
+        template<class Close>
+        void reclaim(uint32_t i, uint32_t state, Close& close) {
+            log_write->warn("shm::host slot {} owner {} is gone, slot reclaimed", i, seg->slots[i].owner.load(std::memory_order_relaxed));
+            if (state == ACTIVE) {
+                close(numbers[i]);
+            }
+            free(seg->slots[i]);
+        }
+
+        void free(slot& s) {
+            s.requests.reset();
+            s.replies.reset();
+            s.owner.store(0, std::memory_order_relaxed);
+            s.state.store(FREE, std::memory_order_release);
+        }
+
+        std::string name;
+        std::unique_ptr<mapping> map;
+        segment* seg;
+        std::array<uint32_t, MAX_SLOTS> numbers{};
+        std::chrono::steady_clock::time_point owner_check{};
+    };
+}
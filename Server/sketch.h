@@ -0,0 +1,228 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace skt {
+
+    constexpr uint32_t HLL_BITS = 10;                   //1024 registers, about 3% error on the distinct count
+    constexpr uint32_t HLL_REGISTERS = 1u << HLL_BITS;
+    constexpr uint32_t KMV_SIZE = 128;                  //sample of distinct values the sum is scaled from
+
+    inline uint64_t hash(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    inline uint32_t leading_zeros(uint64_t x) {
+        if (x == 0) {
+            return 64;
+        }
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, x);
+        return 63 - index;
+#else
+        return static_cast<uint32_t>(__builtin_clzll(x));
+#endif
+    }
+
+    //register and rank a hash updates in a HyperLogLog
+    inline void hll_slot(uint64_t h, uint32_t& index, uint8_t& rank) {
+        index = static_cast<uint32_t>(h >> (64 - HLL_BITS));
+        rank = static_cast<uint8_t>(std::min<uint32_t>(leading_zeros(h << HLL_BITS) + 1, 64 - HLL_BITS + 1));
+    }
+
+    //HyperLogLog registers, two of them merge by taking the larger register
+    class hll final {
+    public:
+        //true when a register grew
+        bool insert_hash(uint64_t h) {
+            uint32_t index;
+            uint8_t rank;
+            hll_slot(h, index, rank);
+            return raise(index, rank);
+        }
+
+        bool raise(uint32_t index, uint8_t rank) {
+            if (rank > registers[index]) {
+                registers[index] = rank;
+                return true;
+            }
+            return false;
+        }
+
+        void merge(const hll& other) {
+            for (uint32_t i = 0; i < HLL_REGISTERS; ++i) {
+                raise(i, other.registers[i]);
+            }
+        }
+
+        //linear counting while many registers are still empty
+        double estimate() const {
+            double m = HLL_REGISTERS;
+            double inverse_sum{ 0 };
+            uint32_t zeros{ 0 };
+            for (uint8_t r : registers) {
+                inverse_sum += std::ldexp(1.0, -r);
+                zeros += r == 0;
+            }
+            double e = 0.7213 / (1 + 1.079 / m) * m * m / inverse_sum;
+            if (e <= 2.5 * m && zeros) {
+                e = m * std::log(m / zeros);
+            }
+            return e;
+        }
+
+        uint8_t* data() {
+            return registers.data();
+        }
+
+        const uint8_t* data() const {
+            return registers.data();
+        }
+    private:
+        std::array<uint8_t, HLL_REGISTERS> registers{};
+    };
+
+    //distinct values seen by one connection in fixed memory: a HyperLogLog counts them and a k minimum values
+    //sample, the KMV_SIZE values with the smallest hashes, is a uniform sample of them, so the sum of distinct
+    //values is the count times the sample mean, the mean is off by about its spread / sqrt(KMV_SIZE)
+    class distinct_sketch final {
+    public:
+        void insert(uint64_t v) {
+            uint64_t h = hash(v);
+            if (registers.insert_hash(h)) {
+                dirty = true;
+            }
+            if (sampled < KMV_SIZE) {
+                if (!in_sample(v)) {
+                    sample[sampled++] = v;
+                    std::push_heap(sample.begin(), sample.begin() + sampled, by_hash);
+                    dirty = true;
+                }
+            }
+            else if (h < hash(sample[0]) && !in_sample(v)) {
+                std::pop_heap(sample.begin(), sample.end(), by_hash);
+                sample[KMV_SIZE - 1] = v;
+                std::push_heap(sample.begin(), sample.end(), by_hash);
+                dirty = true;
+            }
+        }
+
+        //estimates are recomputed only after the registers or the sample changed, which gets rare as the set grows
+        uint64_t count() const {
+            refresh();
+            return cached_count;
+        }
+
+        double sum() const {
+            refresh();
+            return cached_sum;
+        }
+
+        //spread of the sample, which stands for the spread of the distinct values
+        double variance() const {
+            refresh();
+            return cached_variance;
+        }
+
+        //sum / count, which is the mean of the sample
+        uint64_t mean() const {
+            uint64_t c = count();
+            return c ? static_cast<uint64_t>(sum() / c) : 0;
+        }
+
+        //order statistics of the sample stand for those of the distinct values
+        uint64_t quantile(double q) const {
+            if (sampled == 0) {
+                return 0;
+            }
+            q = std::min(std::max(q, 0.0), 1.0);
+            uint32_t k = static_cast<uint32_t>(std::ceil(q * sampled));
+            std::array<uint64_t, KMV_SIZE> sorted = sample;
+            std::nth_element(sorted.begin(), sorted.begin() + (k ? k - 1 : 0), sorted.begin() + sampled);
+            return sorted[k ? k - 1 : 0];
+        }
+
+        uint64_t rank(uint64_t v) const {
+            if (sampled == 0) {
+                return 0;
+            }
+            uint32_t below = static_cast<uint32_t>(std::count_if(sample.begin(), sample.begin() + sampled, [v](uint64_t x) { return x < v; }));
+            return static_cast<uint64_t>(static_cast<double>(below) / sampled * count() + 0.5);
+        }
+
+        //the sampled values stand in for the full set in dumps
+        void sample_values(std::vector<uint64_t>& out) const {
+            out.assign(sample.begin(), sample.begin() + sampled);
+        }
+
+        static constexpr size_t image_size() {
+            return HLL_REGISTERS + sizeof(uint32_t) + KMV_SIZE * sizeof(uint64_t);
+        }
+
+        void serialize(std::vector<uint8_t>& out) const {
+            out.insert(out.end(), registers.data(), registers.data() + HLL_REGISTERS);
+            const uint8_t* p = reinterpret_cast<const uint8_t*>(&sampled);
+            out.insert(out.end(), p, p + sizeof(sampled));
+            p = reinterpret_cast<const uint8_t*>(sample.data());
+            out.insert(out.end(), p, p + KMV_SIZE * sizeof(uint64_t));
+        }
+
+        //data holds image_size() bytes
+        bool deserialize(const uint8_t* data) {
+            memcpy(registers.data(), data, HLL_REGISTERS);
+            memcpy(&sampled, data + HLL_REGISTERS, sizeof(sampled));
+            memcpy(sample.data(), data + HLL_REGISTERS + sizeof(sampled), KMV_SIZE * sizeof(uint64_t));
+            if (sampled > KMV_SIZE) {
+                return false;
+            }
+            std::make_heap(sample.begin(), sample.begin() + sampled, by_hash);
+            dirty = true;
+            return true;
+        }
+    private:
+        void refresh() const {
+            if (!dirty) {
+                return;
+            }
+            dirty = false;
+            cached_count = std::max<uint64_t>(static_cast<uint64_t>(registers.estimate() + 0.5), sampled);
+            double sample_sum{ 0 };
+            for (uint32_t i = 0; i < sampled; ++i) {
+                sample_sum += static_cast<double>(sample[i]);
+            }
+            cached_sum = sampled ? sample_sum / sampled * cached_count : 0;
+            double squares{ 0 };
+            for (uint32_t i = 0; i < sampled; ++i) {
+                double d = static_cast<double>(sample[i]) - sample_sum / sampled;
+                squares += d * d;
+            }
+            cached_variance = sampled ? squares / sampled : 0;
+        }
+
+        static bool by_hash(uint64_t a, uint64_t b) {
+            return hash(a) < hash(b);
+        }
+
+        bool in_sample(uint64_t v) const {
+            return std::find(sample.begin(), sample.begin() + sampled, v) != sample.begin() + sampled;
+        }
+
+        hll registers;
+        std::array<uint64_t, KMV_SIZE> sample{};        //max heap by hash, the root is the largest kept hash
+        uint32_t sampled{ 0 };
+        mutable bool dirty{ false };
+        mutable uint64_t cached_count{ 0 };
+        mutable double cached_sum{ 0 };
+        mutable double cached_variance{ 0 };
+    };
+}
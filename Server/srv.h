@@ -9,68 +9,478 @@
 #include <cstdint>
 #include <queue>
 #include <chrono>
-#include "Logger.h"
+#include <future>
+#include <csignal>
+#include "logger.h"
 #include "connect.h"
 #include "SrvAlg.h"
 #include "dumper.h"
+#include "metrics.h"
+#include "watchdog.h"
+#include "options.h"
+#include "uring.h"
+#include "handoff.h"
+#include "shm_host.h"
+#include "udp_ingest.h"
+#include "affinity.h"
+#include "coro.h"
+#include "numa.h"
 
 namespace srv {
     using namespace con;
     using boost::asio::ip::tcp;
     using namespace std::chrono;
 
+    constexpr uint32_t IDLE_WAIT_MS = 100;          //longest park of a client_io woken by every event it serves
+    constexpr uint32_t POLL_WAIT_MS = 1;            //with shared memory clients, which can't wake it
+    constexpr uint64_t STATS_INTERVAL_MS = 1000;    //heavy hitters logged and posted for the scrape, idle udp ids closed
+    constexpr uint64_t UDP_IDLE_MS = 30000;         //an udp id silent that long is closed and falls under the storage budget
+    constexpr size_t MAX_UDP_CLIENTS = 65536;       //open udp ids, datagrams of further new ids are dropped
+
+    //threaded client_io polls on its own thread, otherwise the owner's loop calls step(),
+    //connection numbers go base, base + stride, ... so shards never hand out the same number,
+    //busy_poll threads never wait and are pinned to cpu, sockets they accept are tuned for latency
+    struct io_config {
+        std::string name{ "client_io" };
+        uint32_t number_base{ 0 };
+        uint32_t number_stride{ 1 };
+        bool threaded{ true };
+        bool busy_poll{ false };
+        int cpu{ -1 };
+        uint32_t busy_poll_us{ 0 };
+        size_t retain_closed{ DEFAULT_RETAIN_CLOSED };
+        size_t storage_budget{ DEFAULT_STORAGE_BUDGET_MB << 20 };
+        size_t approx_threshold{ 0 };
+        wnd::config window;
+        bool order_stats{ false };
+        bool histograms{ false };
+        hst::layout histogram_layout;
+    };
+
     class client_io final {
         struct data_block {
             data_block() {}
-            data_block(tcp_connection::pointer pt_) : pt(pt_){}
+            data_block(connection::pointer pt_) : pt(pt_){}
             data_block(const data_block& db) : pt(db.pt){}
-            tcp_connection::pointer pt;
+            connection::pointer pt;
         };
     public:
-        client_io() {
-            thr_writer = std::thread(std::bind(&client_io::thr_func, this));
+        //poll hook runs on the client_io thread around every iteration, used by transports driven from it
+        explicit client_io(std::function<void()> poll_hook_ = nullptr, const io_config& cfg_ = io_config())
+            : cfg(cfg_), next_number(cfg_.number_base), poll_hook(std::move(poll_hook_)) {
+            finished_future = finished.get_future();
+            storage.set_retention(cfg.retain_closed, cfg.storage_budget);
+            storage.set_approximation(cfg.approx_threshold);
+            storage.set_window(cfg.window);
+            storage.set_order_stats(cfg.order_stats);
+            storage.set_histograms(cfg.histograms, cfg.histogram_layout);
+            storage.set_global(GLOBAL_STATS.make_partial());
+            dwriter.set_histogram_layout(storage.histogram_layout());
+            if (cfg.threaded) {
+                monitor = std::make_unique<wdg::loop_monitor>(cfg.name, IDLE_WAIT_MS);
+                thr_writer = std::thread(std::bind(&client_io::thr_func, this));
+            }
         }
 
         ~client_io() {
-            is_work.store(false);
-            thr_writer.join();
+            stop();
         }
 
-        bool start_io(tcp_connection::pointer pt) {
+        bool start_io(connection::pointer pt) {
+            pt->set_waiter(&ready);
             pq.push(data_block(pt));
+            ready.notify();
             return true;
         }
 
-    private:
-        void thr_func() {
-            log_write->info("client_io::thr_func start thread clients input/output");
-            is_work.store(true);
-            uint32_t connection_number{ 0 };
-            uint64_t start_time = get_tick_count();
-            for (;;) {
-                if (!is_work.load()) {
-                    break;
+        //keeps serving until every stored number has been answered, false if the timeout expired first
+        bool drain(milliseconds timeout) {
+            draining.store(true);
+            ready.notify();
+            std::unique_lock<std::mutex> lock(drain_mtx);
+            return drain_cv.wait_for(lock, timeout, [this] { return drained; });
+        }
+
+        //ends polling, the last step hands a snapshot of the whole storage to the dumper,
+        //without a thread of its own this waits for the owner's loop to run that step
+        void stop() {
+            is_work.store(false);
+            ready.notify();
+            if (thr_writer.joinable()) {
+                thr_writer.join();
+            }
+            finished_future.wait();
+        }
+
+        //one polling iteration, false once stop() was requested and the final snapshot is taken
+        bool step() {
+            if (!is_work.load()) {
+                if (!is_finished) {
+                    is_finished = true;
+                    if (handed_over) {
+                        log_write->info("client_io::step state was handed over, no final snapshot");
+                    }
+                    else {
+                        snapshot_storage();
+                    }
+                    {
+                        const std::lock_guard<std::mutex> lock_mutex(exec_mtx);
+                        loop_done = true;
+                    }
+                    std::function<void()> task;
+                    while (tasks.pop(task)) {           //queued before the loop ended, later ones run on their callers
+                        task();
+                    }
+                    finished.set_value();
+                }
+                return false;
+            }
+            wdg::scope guard("client_io::step");
+            if (poll_hook) {
+                poll_hook();
+            }
+            std::function<void()> task;
+            while (tasks.pop(task)) {
+                task();
+            }
+            data_block db;
+            if (pq.pop(db)) {
+                connections[take_number()] = db.pt;
+            }
+            read_from_connections();
+            get_data_after_read();
+            if (shm_host) {
+                poll_shm();
+            }
+            if (udp_ingest) {
+                poll_udp();
+            }
+            uint64_t tick{};
+            if ((tick = get_tick_count()) >= dump_time + (srv::DUMP_TIMEOUT * 1000)) {
+                dump_connections();
+                dump_time = tick;
+            }
+            write_to_connections();
+            if (poll_hook) {
+                poll_hook();
+            }
+            if (draining.load()) {
+                check_drained();
+            }
+            publish_gauges();
+            if (tick >= stats_time + STATS_INTERVAL_MS) {
+                publish_heavy_hitters();
+                if (udp_ingest) {
+                    close_idle_udp(tick);
+                }
+                stats_time = tick;
+            }
+            return true;
+        }
+
+        void flush_dumps() {
+            dwriter.stop();
+            dwriter.flush();
+        }
+
+        //serves clients of a shared memory segment alongside the socket connections
+        void attach_shm(const std::string& name) {
+            execute([this, &name] {
+                try {
+                    shm_host = std::make_unique<shm::host>(name);
                 }
+                catch (std::exception& e) {
+                    log_write->error("client_io::attach_shm segment {} unavailable: {}", name, e.what());
+                }
+            });
+        }
+
+        //notified by transports that complete work off this thread, a poll hook's engine for one
+        wt::waiter& ready_waiter() {
+            return ready;
+        }
+
+        void attach_udp(std::unique_ptr<dgm::ingest> ingest) {
+            execute([this, &ingest] {
+                ingest->set_waiter(&ready);
+                udp_ingest = std::move(ingest);
+            });
+        }
+
+        //coroutine sessions run on the thread that steps client_io and use its storage directly
+        uint32_t open_session() {
+            uint32_t number = take_number();
+            sessions[number] = 0;
+            return number;
+        }
+
+        //stores a number of a session and gives the mean to reply with, false once the final snapshot is taken
+        bool session_number(uint32_t number_connection, uint32_t number, uint64_t& arithmetic_mean) {
+            if (is_finished) {
+                return false;
+            }
+            storage.to_storage(number_connection, number);
+            METRICS.messages_in.inc();
+            ++sessions[number_connection];
+            storage.get_result(number_connection, arithmetic_mean);
+            return true;
+        }
+
+        void session_replied(uint32_t number_connection, size_t replies) {
+            METRICS.messages_out.inc(replies);
+            sessions[number_connection] -= replies;
+        }
+
+        void close_session(uint32_t number_connection) {
+            sessions.erase(number_connection);
+            retire_connection(number_connection);
+            METRICS.connections_closed.inc();
+        }
+
+#ifndef _WIN32
+        //detaches every connection and serializes storage for a successor process
+        void export_state(handoff::state& st) {
+            execute([this, &st] {
                 data_block db;
-                if (pq.pop(db)) {
-                    connections[connection_number++] = db.pt;
+                while (pq.pop(db)) {
+                    connections[take_number()] = db.pt;
                 }
-                read_from_connections();
                 get_data_after_read();
-                uint64_t tick{};
-                if ((tick = get_tick_count()) >= start_time + (srv::DUMP_TIMEOUT * 1000)) {
-                    dump_connections();
-                    start_time = tick;
+                auto deadline = steady_clock::now() + milliseconds(HANDOFF_WRITE_WAIT_MS);
+                while (writes_in_progress() && steady_clock::now() < deadline) {
+                    std::this_thread::sleep_for(milliseconds(1));
+                }
+                //reads armed until now may still bring numbers, they are stopped and whatever they got is kept
+                for (auto& connection : connections) {
+                    connection.second->cancel_read();
+                }
+                deadline = steady_clock::now() + milliseconds(HANDOFF_WRITE_WAIT_MS);
+                while (reads_in_progress() && steady_clock::now() < deadline) {
+                    std::this_thread::sleep_for(milliseconds(1));
+                }
+                st.next_number = next_number;
+                for (auto& connection : connections) {
+                    auto& conn = connection.second;
+                    handoff::connection_entry entry{ connection.first, 0, -1 };
+                    if (conn->is_read() == RW_STATUS::IN_PROGRESS) {
+                        log_write->warn("client_io::export_state connection {} read did not stop, its bytes in flight are lost", connection.first);
+                    }
+                    else if (conn->is_read() == RW_STATUS::COMPLETE && !store_read(connection.first, *conn)) {
+                        entry.partial_size = static_cast<uint32_t>(std::min(conn->data_size(), sizeof(entry.partial)));
+                    }
+                    else if (conn->is_read() == RW_STATUS::CONNECTION_CLOSE) {
+                        entry.partial_size = static_cast<uint32_t>(std::min(conn->data_size(), sizeof(entry.partial)));
+                    }
+                    memcpy(entry.partial, conn->get_data(), entry.partial_size);
+                    entry.fd = conn->release_handle();
+                    if (entry.fd < 0) {
+                        log_write->warn("client_io::export_state connection {} can't be handed over, dropped", connection.first);
+                        continue;
+                    }
+                    entry.replies_due = static_cast<uint32_t>(conn->replies_pending());
+                    st.connections.push_back(entry);
+                }
+                connections.clear();
+                storage.serialize(st.storage);
+                log_write->info("client_io::export_state {} connections, {} storage bytes", st.connections.size(), st.storage.size());
+            });
+        }
+
+        //the successor got the exported state and dumps its connections from now on, nothing is written here any more
+        void state_handed_over() {
+            execute([this] {
+                handed_over = true;
+                dwriter.discard();
+            });
+        }
+
+        //continues serving state taken over from a predecessor, adopt wraps a socket into a connection
+        void import_state(const handoff::state& st, const std::function<connection::pointer(int)>& adopt) {
+            execute([&] {
+                next_number = st.next_number;
+                if (!storage.deserialize(st.storage)) {
+                    log_write->error("client_io::import_state storage image is truncated");
+                }
+                adopt_connections(st, adopt);
+                std::vector<uint32_t> closed;
+                storage.for_each_number([this, &closed](uint32_t number_connection) {
+                    if (connections.find(number_connection) == connections.end()) {
+                        closed.push_back(number_connection);
+                    }
+                });
+                for (uint32_t number_connection : closed) {
+                    storage.close(number_connection);       //the predecessor's closed and udp/shm clients are retained, not open
+                }
+                log_write->info("client_io::import_state {} connections, {} stored connections", connections.size(), storage.size());
+            });
+        }
+
+        //the successor did not take the exported state, its connections are served here again, storage never left
+        void resume_state(const handoff::state& st, const std::function<connection::pointer(int)>& adopt) {
+            execute([&] {
+                adopt_connections(st, adopt);
+                log_write->info("client_io::resume_state {} connections served again", connections.size());
+            });
+        }
+#endif
+
+    private:
+        //runs task on the client_io thread between iterations and waits for it,
+        //once the loop took its last step nothing else touches the state and the task runs on the caller
+        void execute(std::function<void()> task) {
+            std::promise<void> done;
+            std::unique_lock<std::mutex> lock(exec_mtx);
+            if (loop_done) {
+                lock.unlock();
+                task();
+                return;
+            }
+            tasks.push([&task, &done] {
+                task();
+                done.set_value();
+            });
+            lock.unlock();
+            ready.notify();
+            done.get_future().wait();
+        }
+
+#ifndef _WIN32
+        void adopt_connections(const handoff::state& st, const std::function<connection::pointer(int)>& adopt) {
+            for (auto& entry : st.connections) {
+                auto conn = adopt(entry.fd);
+                conn->set_waiter(&ready);
+                conn->preload(entry.partial, entry.partial_size);
+                for (uint32_t i = 0; i < entry.replies_due; ++i) {
+                    conn->request_reply();
+                }
+                connections[entry.number] = conn;
+            }
+        }
+#endif
+
+        bool reads_in_progress() {
+            for (auto& connection : connections) {
+                if (connection.second->is_read() == RW_STATUS::IN_PROGRESS) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool writes_in_progress() {
+            for (auto& connection : connections) {
+                if (connection.second->is_write() == RW_STATUS::IN_PROGRESS) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void thr_func() {
+            log_write->info("client_io::thr_func start thread clients input/output{}", cfg.busy_poll ? ", busy polling" : "");
+            monitor->attach();
+            if (cfg.cpu >= 0) {
+                aff::pin_current_thread(cfg.cpu);
+            }
+            if (cfg.busy_poll) {
+                uint64_t beat_time = wdg::now_us();
+                while (step()) {
+                    uint64_t now = wdg::now_us();
+                    if (now - beat_time >= 1000) {
+                        monitor->beat(0);
+                        beat_time = now;
+                    }
                 }
-                write_to_connections();
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                log_write->info("client_io::thr_func end thread clients input/output");
+                return;
+            }
+            while (step()) {
+                uint64_t limit = (shm_host ? POLL_WAIT_MS : IDLE_WAIT_MS) * 1000;
+                uint64_t wait_start = wdg::now_us();
+                ready.wait_for(microseconds(limit), [this] { return shm_host && shm_host->pending(); });
+                uint64_t waited = wdg::now_us() - wait_start;
+                monitor->beat(waited > limit ? waited - limit : 0);
             }
             log_write->info("client_io::thr_func end thread clients input/output");
         }
 
+        uint32_t take_number() {
+            uint32_t number = next_number;
+            next_number += cfg.number_stride;
+            return number;
+        }
+
+        //gauges are shared by every client_io, each one adds the change since its last publish
+        void publish_gauges() {
+            auto publish = [](const mtr::gauge& g, int64_t& last, int64_t now) {
+                g.add(now - last);
+                last = now;
+            };
+            publish(METRICS.client_queue_depth, published.queue_depth, pq.size());
+            publish(METRICS.connections_active, published.connections, connections.size() + sessions.size());
+            publish(METRICS.storage_connections, published.storage_connections, storage.size());
+            publish(METRICS.storage_values, published.storage_values, storage.values());
+            publish(METRICS.storage_arena_bytes, published.storage_arena_bytes, storage.reserved_bytes());
+            publish(METRICS.storage_bytes, published.storage_bytes, storage.memory());
+            publish(METRICS.storage_retained, published.storage_retained, storage.retained());
+            publish(METRICS.storage_approx_connections, published.storage_approx_connections, storage.approximated());
+            METRICS.storage_evictions.inc(storage.take_evicted());
+            METRICS.storage_resumes.inc(storage.take_resumed());
+        }
+
+        //the heaviest connections go to the log and to the board the metrics scrape merges
+        void publish_heavy_hitters() {
+            std::vector<tpk::entry> messages, values;
+            storage.heavy_hitters(messages, values);
+            if (messages.empty()) {
+                return;
+            }
+            log_write->info("{}::heavy_hitters messages: {} values: {}", cfg.name, tpk::to_string(messages), tpk::to_string(values));
+            HEAVY_HITTERS.post(cfg.name, "srv_top_connection_messages", std::move(messages));
+            HEAVY_HITTERS.post(cfg.name, "srv_top_connection_values", std::move(values));
+        }
+
+        void check_drained() {
+            if ((shm_host && shm_host->pending()) || (udp_ingest && udp_ingest->pending())) {
+                return;
+            }
+            for (auto& session : sessions) {
+                if (session.second != 0) {
+                    return;
+                }
+            }
+            for (auto& connection : connections) {
+                auto& conn = connection.second;
+                if (conn->reply_due() || conn->is_read() == RW_STATUS::COMPLETE || conn->is_write() == RW_STATUS::IN_PROGRESS) {
+                    return;
+                }
+            }
+            std::unique_lock<std::mutex> lock(drain_mtx);
+            if (!drained) {
+                drained = true;
+                lock.unlock();
+                drain_cv.notify_all();
+            }
+        }
+
+        void snapshot_storage() {
+            wdg::scope guard("client_io::snapshot_storage");
+            size_t count{ 0 };
+            storage.for_each_number([this, &count](uint32_t number_connection) {
+                std::vector<uint64_t> values;
+                storage.get_storage(number_connection, values);
+                std::vector<uint64_t> counts;
+                storage.get_histogram(number_connection, counts);
+                dwriter.to_dump(number_connection, std::move(values), std::move(counts));
+                ++count;
+            });
+            log_write->info("client_io::snapshot_storage {} connections transferred to dumper", count);
+        }
+
         void read_from_connections() {
+            wdg::scope guard("client_io::read_from_connections");
             for (auto it = connections.begin(); it != connections.end();) {
-                if (it->second->is_open() && it->second->is_read() == RW_STATUS::UNKNOWN || it->second->is_read() == RW_STATUS::COMPLETE) {
+                if (it->second->is_open() && it->second->is_read() == RW_STATUS::UNKNOWN) {
                     it->second->read();
                     ++it;
                 }
@@ -78,31 +488,121 @@ namespace srv {
                     log_write->info("client_io::read_from_connections: connection {} in status:{} delete connection", it->first, rw_status_strs[it->second->is_read()].c_str());
                     erase_connection_by_iterator(it);
                 }
+                else {
+                    ++it;
+                }
             }
         }
 
         void get_data_after_read() {
+            wdg::scope guard("client_io::get_data_after_read");
             for (auto it = connections.begin(); it != connections.end();) {
                if (it->second->is_read() == RW_STATUS::COMPLETE) {
-                   size_t sz_data = it->second->data_size();
-                   uint32_t number = *(uint32_t*)it->second->get_data();
-                   log_write->info("client_io::get_data_after_read: connection {} in status:{} read, size data:{} number:{} transfer to storage", it->first, rw_status_strs[it->second->is_read()].c_str(), sz_data, number);
-                   storage.to_storage(it->first, number);
+                   if (!store_read(it->first, *it->second)) {
+                       log_write->warn("client_io::get_data_after_read: connection {} read {} bytes, not a number, delete connection", it->first, it->second->data_size());
+                       erase_connection_by_iterator(it);
+                       continue;
+                   }
+                   it->second->read();                 //next read is armed only after the data was consumed
                    ++it;
                }
                else if (it->second->is_read() == RW_STATUS::CONNECTION_CLOSE) {
                    log_write->info("client_io::get_data_after_read: connection {} in status:{} delete connection", it->first, rw_status_strs[it->second->is_read()].c_str());
                    erase_connection_by_iterator(it);
                }
+               else {
+                   ++it;
+               }
            }
         }
 
+        //the number of a completed read goes to storage and is owed a reply, false when the read is not a whole number
+        bool store_read(uint32_t number_connection, connection& conn) {
+            size_t sz_data = conn.data_size();
+            if (sz_data != sizeof(uint32_t)) {
+                return false;
+            }
+            uint32_t number = *(uint32_t*)conn.get_data();
+            log_write->info("client_io::get_data_after_read: connection {} in status:{} read, size data:{} number:{} transfer to storage", number_connection, rw_status_strs[conn.is_read()].c_str(), sz_data, number);
+            storage.to_storage(number_connection, number);
+            METRICS.messages_in.inc();
+            conn.request_reply();
+            return true;
+        }
+
+        //same storage path as socket reads, replies go straight back into the slot ring
+        void poll_shm() {
+            wdg::scope guard("client_io::poll_shm");
+            shm_host->poll(
+                [this] {
+                    METRICS.connections_accepted.inc();
+                    return take_number();
+                },
+                [this](uint32_t number_connection, uint32_t number) {
+                    storage.to_storage(number_connection, number);
+                    METRICS.messages_in.inc();
+                    uint64_t arithmetic_mean{};
+                    storage.get_result(number_connection, arithmetic_mean);
+                    METRICS.messages_out.inc();
+                    return arithmetic_mean;
+                },
+                [this](uint32_t number_connection) {
+                    retire_connection(number_connection);
+                    METRICS.connections_closed.inc();
+                });
+        }
+
+        //udp clients get no reply per number, only a datagram without numbers is answered with the mean
+        void poll_udp() {
+            wdg::scope guard("client_io::poll_udp");
+            dgm::batch b;
+            uint64_t tick = get_tick_count();
+            while (udp_ingest->pop(b)) {
+                for (auto& d : b.datagrams) {
+                    auto client = udp_clients.find(d.number_connection);
+                    if (client == udp_clients.end()) {
+                        if (udp_clients.size() >= MAX_UDP_CLIENTS) {
+                            METRICS.udp_dropped.inc();
+                            continue;
+                        }
+                        client = udp_clients.emplace(d.number_connection, tick).first;
+                        METRICS.connections_accepted.inc();
+                    }
+                    client->second = tick;
+                    if (d.count == 0) {
+                        uint64_t arithmetic_mean{};
+                        storage.get_result(d.number_connection, arithmetic_mean);
+                        METRICS.messages_out.inc();
+                        udp_ingest->reply(d, arithmetic_mean);
+                        continue;
+                    }
+                    storage.to_storage(d.number_connection, std::span<const uint32_t>(b.numbers.data() + d.first, d.count));
+                    METRICS.messages_in.inc(d.count);
+                }
+            }
+        }
+
+        //udp ids never say they are gone, a silent one is retired like a closed connection and opened again by its next datagram
+        void close_idle_udp(uint64_t tick) {
+            for (auto it = udp_clients.begin(); it != udp_clients.end();) {
+                if (tick - it->second < UDP_IDLE_MS) {
+                    ++it;
+                    continue;
+                }
+                retire_connection(it->first);
+                METRICS.connections_closed.inc();
+                it = udp_clients.erase(it);
+            }
+        }
+
         void write_to_connections() {
+            wdg::scope guard("client_io::write_to_connections");
             for (auto it = connections.begin(); it != connections.end();) {
-                if (it->second->is_open() && it->second->is_write() == RW_STATUS::UNKNOWN || it->second->is_write() == RW_STATUS::COMPLETE) {
+                if (it->second->is_open() && (it->second->is_write() == RW_STATUS::UNKNOWN || it->second->is_write() == RW_STATUS::COMPLETE) && it->second->take_reply()) {
                     uint64_t arithmetic_mean{};
-                    if (storage.get_arithmetic_mean(it->first, arithmetic_mean)) {              //   
+                    if (storage.get_result(it->first, arithmetic_mean)) {              //   
                         log_write->info("client_io::write_to_connections connect:{} status {} send number:{}", it->first, rw_status_strs[it->second->is_write()], arithmetic_mean);
+                        METRICS.messages_out.inc();
                         it->second->write((uint8_t*)&arithmetic_mean, sizeof(arithmetic_mean)); //   
                     }
                     ++it;
@@ -111,24 +611,55 @@ namespace srv {
                     log_write->info("client_io::write_to_connections: connection {} in status:{} delete connection", it->first, rw_status_strs[it->second->is_write()].c_str());
                     erase_connection_by_iterator(it);
                 }
+                else {
+                    ++it;
+                }
             }
         }
 
-        void erase_connection_by_iterator(std::unordered_map<uint32_t, tcp_connection::pointer>::iterator &it) {
+        void erase_connection_by_iterator(std::unordered_map<uint32_t, connection::pointer>::iterator &it) {
             auto del_it = it;
             ++it;
+            retire_connection(del_it->first);
             connections.erase(del_it);
+            METRICS.connections_closed.inc();
+        }
+
+        //the final state goes to disk first, storage keeps it until the retention policy evicts it
+        void retire_connection(uint32_t number_connection) {
+            std::string stats;
+            if (storage.describe(number_connection, stats)) {
+                log_write->info("client_io::retire_connection connect:{} {}", number_connection, stats);
+            }
+            dump_number(number_connection);
+            storage.close(number_connection);
+        }
+
+        void dump_number(uint32_t number_connection) {
+            std::vector<uint64_t> nums;
+            if (storage.get_storage(number_connection, nums)) {
+                std::vector<uint64_t> counts;
+                storage.get_histogram(number_connection, counts);
+                dwriter.to_dump(number_connection, std::move(nums), std::move(counts));
+            }
         }
         void dump_connections() {
+            wdg::scope guard("client_io::dump_connections");
             for (auto connection : connections) {
-                if (connection.second->is_read() == RW_STATUS::COMPLETE) {
-                    log_write->info("client_io::dump_connections connect:{} in status{} transfer to dumper thread", connection.first, rw_status_strs[RW_STATUS::COMPLETE]);
-                    std::unordered_set<uint64_t> nums;
-                    if (storage.get_storage(connection.first, nums)) {
-                        dwriter.to_dump(connection.first, nums);
-                    }
+                if (connection.second->is_read() != RW_STATUS::CONNECTION_CLOSE) {
+                    log_write->info("client_io::dump_connections connect:{} in status{} transfer to dumper thread", connection.first, rw_status_strs[connection.second->is_read()]);
+                    dump_number(connection.first);
                 }
             }
+            if (shm_host) {
+                shm_host->for_each_active([this](uint32_t number_connection) { dump_number(number_connection); });
+            }
+            for (auto& client : udp_clients) {
+                dump_number(client.first);
+            }
+            for (auto& session : sessions) {
+                dump_number(session.first);
+            }
         }
 
         uint64_t get_tick_count() {
@@ -136,57 +667,610 @@ namespace srv {
         }
 
     private:
-        std::unordered_map<uint32_t, tcp_connection::pointer> connections;
+        wt::waiter ready;                   //woken by completions, new connections and tasks, outlives the connections
+        std::unordered_map<uint32_t, connection::pointer> connections;
         salg::parallel_queue<data_block> pq;
+        salg::parallel_queue<std::function<void()>> tasks;
+        io_config cfg;
+        uint32_t next_number{ 0 };
+        uint64_t dump_time{ get_tick_count() };
+        uint64_t stats_time{ get_tick_count() };
+        struct {
+            int64_t queue_depth{};
+            int64_t connections{};
+            int64_t storage_connections{};
+            int64_t storage_values{};
+            int64_t storage_arena_bytes{};
+            int64_t storage_bytes{};
+            int64_t storage_retained{};
+            int64_t storage_approx_connections{};
+        } published;
+        std::promise<void> finished;
+        std::future<void> finished_future;
+        bool is_finished{ false };
+        bool handed_over{ false };          //storage went to a successor process, its dumps are not written here
+        std::mutex exec_mtx;
+        bool loop_done{ false };            //set under exec_mtx by the last step, execute runs tasks inline from then on
         std::thread thr_writer{};
-        std::atomic_bool is_work{ false };
-        salg::storage_numbers storage;
+        std::atomic_bool is_work{ true };
+        std::atomic_bool draining{ false };
+        std::mutex drain_mtx;
+        std::condition_variable drain_cv;
+        bool drained{ false };
+        salg::storage_type storage;
         dump_writer dwriter;
+        std::unique_ptr<wdg::loop_monitor> monitor;
+        std::function<void()> poll_hook;
+        std::unique_ptr<shm::host> shm_host;
+        std::unique_ptr<dgm::ingest> udp_ingest;
+        std::unordered_map<uint32_t, uint64_t> udp_clients;   //open udp ids and the tick of their last datagram
+        std::unordered_map<uint32_t, size_t> sessions;        //coroutine sessions and their replies in flight
     };
 
-    class tcp_server 
+    class server_base {
+    public:
+        virtual ~server_base() = default;
+        virtual void stop_accept() = 0;
+        //the client_io that also serves shared memory, udp and hot restart
+        virtual client_io& io() = 0;
+        virtual bool drain(milliseconds timeout) {
+            return io().drain(timeout);
+        }
+        virtual void stop_io() {
+            io().stop();
+        }
+        virtual void flush_dumps() {
+            io().flush_dumps();
+        }
+        //closes accepting and returns a duplicate of the listening socket for a successor, -1 if unsupported
+        virtual int release_listener() {
+            return -1;
+        }
+#ifndef _WIN32
+        //a handoff that failed after release_listener: serves the listener and exported connections again,
+        //the descriptors in st stay owned by the caller
+        virtual void resume_state(const handoff::state&) {}
+#endif
+        //false when the server runs its sockets on io_contexts of its own
+        virtual bool on_manager_context() const {
+            return true;
+        }
+    };
+
+    inline void remove_socket_file(const tcp::endpoint&) {}
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    inline void remove_socket_file(const boost::asio::local::stream_protocol::endpoint& ep) {
+        ::unlink(ep.path().c_str());
+    }
+#endif
+
+    //accepts stream connections, tcp or unix domain, and serves them on its own client_io
+    template<class Protocol>
+    class stream_server : public server_base
     {
     public:
-        tcp_server(boost::asio::io_context& io_context, uint16_t port)
+        using endpoint_type = typename Protocol::endpoint;
+        using connection_type = stream_connection<Protocol>;
+
+        stream_server(boost::asio::io_context& io_context, const endpoint_type& ep, const io_config& cfg_ = io_config())
             : io_context_(io_context),
-            acceptor_(io_context, tcp::endpoint(tcp::v4(), port))
+            endpoint_(ep),
+            acceptor_(io_context),
+            cfg(cfg_),
+            cio(nullptr, cfg_)
         {
+            remove_socket_file(ep);                 //stale path left behind by a crashed server
+            acceptor_.open(ep.protocol());
+            acceptor_.set_option(typename Protocol::acceptor::reuse_address(true));
+            acceptor_.bind(ep);
+            acceptor_.listen();
             start_accept();
         }
 
+#ifndef _WIN32
+        //adopts the listening socket and connections of the process being replaced
+        stream_server(boost::asio::io_context& io_context, const endpoint_type& ep, const handoff::state& taken, const io_config& cfg_ = io_config())
+            : io_context_(io_context),
+            endpoint_(ep),
+            acceptor_(io_context, ep.protocol(), taken.listen_fd),
+            cfg(cfg_),
+            cio(nullptr, cfg_)
+        {
+            cio.import_state(taken, [this](int fd) {
+                return adopt_socket(fd);
+            });
+            start_accept();
+        }
+
+        //close runs on the io thread, accepts completed before it still reach client_io
+        int release_listener() override {
+            std::promise<int> released;
+            auto release = [this, &released] {
+                int fd = ::dup(acceptor_.native_handle());
+                boost::system::error_code ec;
+                acceptor_.close(ec);
+                released.set_value(fd);
+            };
+            if (io_context_.stopped()) {
+                release();                          //nothing runs the context any more
+            }
+            else {
+                boost::asio::post(io_context_, release);
+            }
+            handed_over = true;
+            return released.get_future().get();
+        }
+
+        void resume_state(const handoff::state& st) override {
+            std::promise<void> resumed;
+            auto resume = [this, &st, &resumed] {
+                boost::system::error_code ec;
+                acceptor_.assign(endpoint_.protocol(), ::dup(st.listen_fd), ec);
+                if (ec) {
+                    log_write->error("stream_server::resume_state listener error:{} message:{}", ec.value(), ec.message());
+                }
+                else {
+                    start_accept();
+                }
+                resumed.set_value();
+            };
+            if (io_context_.stopped()) {
+                resume();
+            }
+            else {
+                boost::asio::post(io_context_, resume);
+            }
+            resumed.get_future().wait();
+            handed_over = false;
+            cio.resume_state(st, [this](int fd) {
+                return adopt_socket(::dup(fd));
+            });
+        }
+#endif
+
+        ~stream_server() {
+            if (!handed_over) {
+                remove_socket_file(endpoint_);      //a successor keeps serving on the same path
+            }
+        }
+
+        void stop_accept() override {
+            boost::asio::post(io_context_, [this] {
+                boost::system::error_code ec;
+                acceptor_.close(ec);
+            });
+        }
+
+        client_io& io() override {
+            return cio;
+        }
+
     private:
+#ifndef _WIN32
+        typename connection_type::pointer adopt_socket(int fd) {
+            typename connection_type::pointer conn = connection_type::create(io_context_, 4);
+            conn->socket().assign(endpoint_.protocol(), fd);
+            return conn;
+        }
+#endif
+
         void start_accept()
         {
             log_write->info("start accept client");
-            tcp_connection::pointer new_connection =
-                tcp_connection::create(io_context_, 4);
+            typename connection_type::pointer new_connection =
+                connection_type::create(io_context_, 4);
 
             acceptor_.async_accept(new_connection->socket(),
-                boost::bind(&tcp_server::handle_accept, this, new_connection,
+                boost::bind(&stream_server::handle_accept, this, new_connection,
                     boost::asio::placeholders::error));
             
         }
         std::shared_ptr<std::string> message_;
-        void handle_accept(tcp_connection::pointer new_connection,
+        void handle_accept(typename connection_type::pointer new_connection,
             const boost::system::error_code& error)
         {
+            wdg::scope guard("stream_server::handle_accept");
             log_write->info("accept new connection error:{} message:{}",error.value(), error.message().c_str());
             if (!error)
             {
+                METRICS.connections_accepted.inc();
+                if (cfg.busy_poll) {
+                    tune_low_latency(new_connection->socket(), cfg.busy_poll_us);
+                }
                 cio.start_io(new_connection);
             }
+            else if (error == boost::asio::error::operation_aborted || !acceptor_.is_open()) {
+                log_write->info("stream_server stop accept");
+                return;
+            }
 
             start_accept();
         }
 
     protected:
         boost::asio::io_context& io_context_;
-        tcp::acceptor acceptor_;
+        endpoint_type endpoint_;
+        typename Protocol::acceptor acceptor_;
+        io_config cfg;
+        client_io cio;
+        bool handed_over{ false };
+    };
+
+    using tcp_server = stream_server<tcp>;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    using local_server = stream_server<boost::asio::local::stream_protocol>;
+#endif
+
+#ifdef __linux__
+    //io_uring transport, the ring is submitted and reaped on the client_io thread
+    class uring_server final : public server_base {
+    public:
+        explicit uring_server(const tcp::endpoint& ep, const io_config& cfg = io_config())
+            : eng(std::make_unique<uring::engine>(ep, 4, [this](connection::pointer conn) {
+                METRICS.connections_accepted.inc();
+                cio.start_io(conn);
+            })),
+            cio([this] { eng->poll(); }, cfg)
+        {
+            eng->set_waiter(&cio.ready_waiter());
+        }
+
+        //the client_io thread stops polling the engine before the engine and its notifier go
+        ~uring_server() {
+            eng->set_waiter(nullptr);
+            cio.stop();
+            eng.reset();
+        }
+
+        void stop_accept() override {
+            eng->stop_accept();
+        }
+
+        client_io& io() override {
+            return cio;
+        }
+    private:
+        std::unique_ptr<uring::engine> eng;
         client_io cio;
     };
+#endif
+
+    //where a shard runs, a cpu of -1 is the core of the shard's index, a node of -1 leaves memory placement to the system
+    struct shard_placement {
+        int cpu{ -1 };
+        int node{ -1 };
+    };
+
+    //one core of the sharded server: an io_context, its connections, storage and dumps, all on one pinned thread
+    class shard final {
+    public:
+        //base carries the busy poll settings
+        shard(size_t index_, size_t count, const io_config& base, const shard_placement& place)
+            : index(index_),
+            cpu(place.cpu >= 0 ? static_cast<size_t>(place.cpu) : aff::worker_cpu(index_)),
+            node(place.node),
+            busy_poll(base.busy_poll),
+            work(boost::asio::make_work_guard(io_context)),
+            timer(io_context),
+            cfg(shard_config(base, index_, count))
+        {
+            std::promise<void> started;
+            auto constructed = started.get_future();
+            thr = std::thread(&shard::thr_func, this, std::move(started));   //the thread owns the promise it may still be inside
+            try {
+                constructed.get();
+            }
+            catch (...) {
+                thr.join();
+                throw;
+            }
+        }
+
+        ~shard() {
+            if (cio) {
+                cio->stop();
+            }
+            work.reset();
+            io_context.stop();
+            if (thr.joinable()) {
+                thr.join();
+            }
+        }
+
+        shard(const shard&) = delete;
+        shard& operator=(const shard&) = delete;
+
+        boost::asio::io_context& context() {
+            return io_context;
+        }
+
+        client_io& io() {
+            return *cio;
+        }
+    private:
+        //every shard steps its own client_io and gets an equal part of the storage budget
+        static io_config shard_config(const io_config& base, size_t index, size_t count) {
+            io_config cfg = base;
+            cfg.name = "client_io_shard" + std::to_string(index);
+            cfg.number_base = static_cast<uint32_t>(index);
+            cfg.number_stride = static_cast<uint32_t>(count);
+            cfg.threaded = false;
+            cfg.busy_poll = false;
+            cfg.cpu = -1;
+            cfg.storage_budget = base.storage_budget / count;
+            return cfg;
+        }
+
+        //client_io, its storage and its dump_writer are made here after the memory policy is set,
+        //so the pages they touch first come from the shard's node
+        void thr_func(std::promise<void> started) {
+            bool pinned = aff::pin_current_thread(cpu);
+            bool local = numa::prefer_node(node);
+            try {
+                cio = std::make_unique<client_io>(nullptr, cfg);
+            }
+            catch (...) {
+                started.set_exception(std::current_exception());
+                return;
+            }
+            started.set_value();
+            log_write->info("shard::thr_func {} start{}{}{}", index, pinned ? ", pinned to cpu " + std::to_string(cpu) : "",
+                local ? ", memory on node " + std::to_string(node) : "", busy_poll ? ", busy polling" : "");
+            wdg::loop_monitor monitor("shard" + std::to_string(index), wdg::LAG_PROBE_MS);
+            monitor.attach();
+            wdg::lag_probe probe(io_context, monitor);
+            if (busy_poll) {
+                bool stepping{ true };
+                while (!io_context.stopped()) {
+                    io_context.poll();
+                    if (stepping) {
+                        stepping = cio->step();
+                    }
+                }
+            }
+            else {
+                schedule_step();
+                io_context.run();
+            }
+            log_write->info("shard::thr_func {} end", index);
+        }
+
+        //client_io is stepped from the shard's own loop, so connection handlers and polling never race
+        void schedule_step() {
+            timer.expires_after(milliseconds(1));
+            timer.async_wait([this](const boost::system::error_code& error) {
+                if (!error && cio->step()) {
+                    schedule_step();
+                }
+            });
+        }
+    private:
+        size_t index;
+        size_t cpu;
+        int node;
+        bool busy_poll;
+        boost::asio::io_context io_context;
+        boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+        boost::asio::steady_timer timer;
+        io_config cfg;
+        std::unique_ptr<client_io> cio;
+        std::thread thr{};
+    };
+
+#ifdef SRV_HAS_COROUTINES
+    constexpr size_t SESSION_BATCH = 128;
+
+    //one connection as straight line code: read whatever arrived, store every whole number,
+    //answer them with one write, the frame and the operations in flight live in the session arena
+    template<class Protocol>
+    cor::task serve_session(std::shared_ptr<cor::session<Protocol>> s, client_io& cio) {
+        uint32_t number_connection = cio.open_session();
+        log_write->info("serve_session: connection {} started", number_connection);
+        cor::frame_arena& arena = *s->arena();
+        uint8_t in[SESSION_BATCH * sizeof(uint32_t)];
+        uint64_t out[SESSION_BATCH];
+        size_t have{ 0 };
+        bool open{ true };
+        while (open) {
+            cor::io_result rd = co_await cor::async_read_some(s->socket(), boost::asio::buffer(in + have, sizeof(in) - have), arena);
+            if (rd.ec) {
+                log_write->info("serve_session: connection {} read error:{} message:{}", number_connection, rd.ec.value(), rd.ec.message());
+                break;
+            }
+            METRICS.bytes_in.inc(rd.bytes);
+            have += rd.bytes;
+            size_t count = have / sizeof(uint32_t);
+            size_t replies{ 0 };
+            {
+                wdg::scope guard("serve_session::store");
+                for (; replies < count; ++replies) {
+                    uint32_t number{};
+                    memcpy(&number, in + replies * sizeof(uint32_t), sizeof(number));
+                    if (!cio.session_number(number_connection, number, out[replies])) {
+                        open = false;
+                        break;
+                    }
+                }
+            }
+            have -= count * sizeof(uint32_t);
+            memmove(in, in + count * sizeof(uint32_t), have);       //a number split between reads waits for its tail
+            if (replies) {
+                cor::io_result wr = co_await cor::async_write(s->socket(), boost::asio::buffer(out, replies * sizeof(uint64_t)), arena);
+                cio.session_replied(number_connection, replies);
+                if (wr.ec) {
+                    log_write->info("serve_session: connection {} write error:{} message:{}", number_connection, wr.ec.value(), wr.ec.message());
+                    break;
+                }
+                METRICS.bytes_out.inc(wr.bytes);
+            }
+        }
+        cio.close_session(number_connection);
+        log_write->info("serve_session: connection {} closed", number_connection);
+    }
+#endif
+
+    //shared nothing mode: every shard accepts on its own SO_REUSEPORT socket where the platform has it,
+    //otherwise shard 0 accepts and passes each connection to the next shard by posting to its io_context
+    template<class Protocol>
+    class sharded_server final : public server_base {
+    public:
+        using endpoint_type = typename Protocol::endpoint;
+        using connection_type = stream_connection<Protocol>;
+        using socket_type = typename Protocol::socket;
+
+        //coroutines serves each connection by serve_session instead of the client_io polling,
+        //shard i runs where places[i] says when the list has it, a shard placed on a numa node marks
+        //its listener with its cpu so the kernel hands it the connections that cpu received
+        sharded_server(const endpoint_type& ep, size_t count, bool reuse_port, bool coroutines_,
+            const io_config& cfg_ = io_config(), const std::vector<shard_placement>& places = std::vector<shard_placement>())
+            : endpoint_(ep), coroutines(coroutines_), cfg(cfg_) {
+            for (size_t i = 0; i < count; ++i) {
+                shards.push_back(std::make_unique<shard>(i, count, cfg, i < places.size() ? places[i] : shard_placement()));
+            }
+            remove_socket_file(ep);
+            size_t acceptors_count = reuse_port ? count : 1;
+            for (size_t i = 0; i < acceptors_count; ++i) {
+                auto acceptor = std::make_unique<typename Protocol::acceptor>(shards[i]->context());
+                acceptor->open(ep.protocol());
+                acceptor->set_option(typename Protocol::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+                if (reuse_port) {
+                    acceptor->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+                    if (i < places.size() && places[i].node >= 0 && places[i].cpu >= 0) {
+                        numa::set_incoming_cpu(acceptor->native_handle(), static_cast<uint32_t>(places[i].cpu));
+                    }
+                }
+#endif
+                acceptor->bind(ep);
+                acceptor->listen();
+                acceptors.push_back(std::move(acceptor));
+            }
+            for (size_t i = 0; i < acceptors.size(); ++i) {
+                boost::asio::post(shards[i]->context(), [this, i] { start_accept(i); });
+            }
+            log_write->info("sharded_server: {} shards, {} acceptors, {} connections", count, acceptors_count, coroutines ? "coroutine" : "polled");
+        }
+
+        ~sharded_server() {
+            for (size_t i = 0; i < acceptors.size(); ++i) {
+                on_shard(i, [this, i] {
+                    boost::system::error_code ec;
+                    acceptors[i]->close(ec);
+                });
+            }
+            remove_socket_file(endpoint_);
+        }
+
+        void stop_accept() override {
+            for (size_t i = 0; i < acceptors.size(); ++i) {
+                boost::asio::post(shards[i]->context(), [this, i] {
+                    boost::system::error_code ec;
+                    acceptors[i]->close(ec);
+                });
+            }
+        }
+
+        client_io& io() override {
+            return shards.front()->io();
+        }
+
+        bool drain(milliseconds timeout) override {
+            auto deadline = steady_clock::now() + timeout;
+            bool drained = true;
+            for (auto& sh : shards) {
+                auto left = duration_cast<milliseconds>(deadline - steady_clock::now());
+                drained = sh->io().drain(std::max(left, milliseconds(0))) && drained;
+            }
+            return drained;
+        }
+
+        void stop_io() override {
+            for (auto& sh : shards) {
+                sh->io().stop();
+            }
+        }
+
+        void flush_dumps() override {
+            for (auto& sh : shards) {
+                sh->io().flush_dumps();
+            }
+        }
+
+        bool on_manager_context() const override {
+            return false;
+        }
+    private:
+        template<class F>
+        void on_shard(size_t i, F&& f) {
+            std::promise<void> done;
+            boost::asio::post(shards[i]->context(), [&f, &done] {
+                f();
+                done.set_value();
+            });
+            done.get_future().wait();
+        }
+
+        //the socket is accepted onto the io_context of the shard that will own it
+        void start_accept(size_t a) {
+            size_t target = acceptors.size() > 1 ? a : next_shard++ % shards.size();
+            acceptors[a]->async_accept(shards[target]->context(),
+                [this, a, target](const boost::system::error_code& error, socket_type peer) {
+                    handle_accept(a, target, error, std::move(peer));
+                });
+        }
+
+        void handle_accept(size_t a, size_t target, const boost::system::error_code& error, socket_type peer) {
+            if (error == boost::asio::error::operation_aborted) {
+                return;
+            }
+            wdg::scope guard("sharded_server::handle_accept");
+            log_write->info("accept new connection shard:{} error:{} message:{}", target, error.value(), error.message().c_str());
+            if (!error) {
+                METRICS.connections_accepted.inc();
+                if (cfg.busy_poll) {
+                    tune_low_latency(peer, cfg.busy_poll_us);
+                }
+                std::function<void()> serve = make_serve(target, std::move(peer));
+                if (target == a) {
+                    serve();
+                }
+                else {
+                    boost::asio::post(shards[target]->context(), std::move(serve));
+                }
+            }
+            else if (!acceptors[a]->is_open()) {
+                log_write->info("sharded_server stop accept");
+                return;
+            }
+            start_accept(a);
+        }
+
+        //what the owning shard runs to take the connection on, the connection is allocated there
+        //so its buffers come from the shard's node
+        std::function<void()> make_serve(size_t target, socket_type&& peer) {
+            auto accepted = std::make_shared<socket_type>(std::move(peer));
+#ifdef SRV_HAS_COROUTINES
+            if (coroutines) {
+                return [this, target, accepted] {
+                    serve_session<Protocol>(std::make_shared<cor::session<Protocol>>(std::move(*accepted)), shards[target]->io());
+                };
+            }
+#endif
+            return [this, target, accepted] {
+                typename connection_type::pointer new_connection = connection_type::create(shards[target]->context(), 4);
+                new_connection->socket() = std::move(*accepted);
+                shards[target]->io().start_io(new_connection);
+            };
+        }
+    private:
+        endpoint_type endpoint_;
+        std::vector<std::unique_ptr<shard>> shards;
+        std::vector<std::unique_ptr<typename Protocol::acceptor>> acceptors;
+        size_t next_shard{ 0 };
+        bool coroutines;
+        io_config cfg;
+    };
 
-    constexpr uint16_t DEFAULT_PORT = 64000;
-    
     class srv_mgr final {
     public:
 
@@ -199,21 +1283,284 @@ namespace srv {
             static srv_mgr smgr;
             return smgr;
         }
-        void start(uint16_t port_ = DEFAULT_PORT) {
-            port = port_;
-            thr_mgr = std::thread(std::bind(&srv_mgr::thread_func, this));
+        void start(const options& opts_ = options()) {
+            opts = opts_;
+            WATCHDOG.start();
+            try {
+                server = make_server();
+                if (!opts.shm_name.empty()) {
+                    server->io().attach_shm(opts.shm_name);
+                }
+                if (opts.udp_endpoint.port) {
+                    boost::asio::ip::udp::endpoint ep(boost::asio::ip::make_address(opts.udp_endpoint.host), opts.udp_endpoint.port);
+                    server->io().attach_udp(std::make_unique<dgm::ingest>(io_context, ep));
+                }
+#ifndef _WIN32
+                if (!opts.handoff_path.empty()) {
+                    successor_listener = std::make_unique<handoff::listener>(io_context, opts.handoff_path, [this](int fd) {
+                        if (thr_handoff.joinable()) {
+                            thr_handoff.join();             //a failed handoff that rearmed the listener as its last step
+                        }
+                        thr_handoff = std::thread(std::bind(&srv_mgr::hand_over, this, fd));
+                    });
+                }
+#endif
+            }
+            catch (std::exception& e)
+            {
+                log_write->error(e.what());
+            }
+            try {
+                if (taken_metrics_fd >= 0 && opts.metrics_port) {
+                    exporter = std::make_unique<mtr::http_exporter>(io_context, std::exchange(taken_metrics_fd, -1));
+                }
+                else if (opts.metrics_port) {
+                    exporter = std::make_unique<mtr::http_exporter>(io_context, opts.metrics_port);
+                }
+#ifndef _WIN32
+                if (taken_metrics_fd >= 0) {
+                    ::close(std::exchange(taken_metrics_fd, -1));      //this process serves no metrics
+                }
+#endif
+            }
+            catch (std::exception& e)
+            {
+                log_write->error("server manager: metrics exporter unavailable: {}", e.what());
+            }
+            int mgr_cpu = opts.busy_poll && server && server->on_manager_context() ? take_cpu() : -1;
+            thr_mgr = std::thread(std::bind(&srv_mgr::thread_func, this, mgr_cpu));
         }
+
+        //stop accepting, drain in-flight requests, snapshot storage, flush dumps, stop the io thread
         void stop() {
+            auto stage_start = steady_clock::now();
+            auto stage_end = [&stage_start](const char* stage) {
+                auto now = steady_clock::now();
+                log_write->info("srv_mgr::stop stage {} took {} ms", stage, duration_cast<milliseconds>(now - stage_start).count());
+                stage_start = now;
+            };
+            if (server && handed_over.load()) {
+                log_write->info("srv_mgr::stop state was handed over, the successor takes the snapshot and writes the dumps");
+            }
+            if (server) {
+                server->stop_accept();
+                stage_end("stop accepting");
+                if (!handed_over.load() && !server->drain(milliseconds(opts.drain_timeout_ms))) {
+                    log_write->warn("srv_mgr::stop drain deadline {} ms expired with requests in flight", opts.drain_timeout_ms);
+                }
+                stage_end("drain");
+                server->stop_io();
+                stage_end("final snapshot");
+                server->flush_dumps();
+                stage_end("flush dumps");
+            }
             io_context.stop();
             thr_mgr.join();
+            if (thr_handoff.joinable()) {
+                thr_handoff.join();
+            }
+#ifndef _WIN32
+            successor_listener.reset();
+#endif
+            server.reset();
+            exporter.reset();
+            stage_end("teardown");
+            WATCHDOG.stop();
         }
     private:
         srv_mgr() = default;
-        void thread_func() {
-            log_write->info("start server manager thread function");
+
+        std::unique_ptr<server_base> make_server() {
+#ifndef _WIN32
+            if (opts.takeover && !opts.handoff_path.empty()) {
+                if (opts.backend != io_backend::ASIO) {
+                    log_write->warn("server manager: hot restart takes over asio connections, using asio");
+                }
+                auto taken = handoff::receive(opts.handoff_path);
+                if (taken) {
+                    taken_metrics_fd = std::exchange(taken->metrics_fd, -1);
+                    log_write->info("server manager: took over listening socket and {} connections", taken->connections.size());
+                    return make_stream_server(taken.get());
+                }
+                log_write->warn("server manager: takeover failed, starting fresh on {}", ept::to_string(opts.endpoint));
+            }
+#endif
+#ifndef SRV_HAS_COROUTINES
+            if (opts.coroutines) {
+                log_write->warn("server manager: coroutine connections need a C++20 build, polled connections are used");
+                opts.coroutines = false;
+            }
+#endif
+            if (opts.backend == io_backend::URING && (opts.shards > 1 || opts.coroutines)) {
+                log_write->warn("server manager: sharded mode runs on asio, io_uring backend ignored");
+            }
+            else if (opts.backend == io_backend::URING && opts.endpoint.kind != ept::transport::TCP) {
+                log_write->warn("server manager: io_uring backend serves tcp only, using asio for {}", ept::to_string(opts.endpoint));
+            }
+#ifdef __linux__
+            else if (opts.backend == io_backend::URING) {
+                try {
+                    tcp::endpoint ep(boost::asio::ip::make_address(opts.endpoint.host), opts.endpoint.port);
+                    auto userver = std::make_unique<uring_server>(ep, make_io_config());
+                    log_write->info("server manager: io_uring backend on {}", ept::to_string(opts.endpoint));
+                    return userver;
+                }
+                catch (std::exception& e) {
+                    log_write->error("server manager: io_uring backend unavailable ({}), falling back to asio", e.what());
+                }
+            }
+#else
+            else if (opts.backend == io_backend::URING) {
+                log_write->warn("server manager: io_uring backend is Linux only, using asio");
+            }
+#endif
+            return make_stream_server(nullptr);
+        }
+
+        //asio backend for the configured endpoint, taken is the state of a predecessor on hot restart
+        std::unique_ptr<server_base> make_stream_server(const handoff::state* taken) {
+            log_write->info("server manager: asio backend on {}", ept::to_string(opts.endpoint));
+            if (opts.endpoint.kind == ept::transport::UNIX) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+                return create_stream_server<boost::asio::local::stream_protocol>(boost::asio::local::stream_protocol::endpoint(opts.endpoint.path), taken);
+#else
+                throw std::runtime_error("unix domain sockets are not supported on this platform");
+#endif
+            }
+            tcp::endpoint ep(boost::asio::ip::make_address(opts.endpoint.host), opts.endpoint.port);
+            return create_stream_server<tcp>(ep, taken);
+        }
+
+        template<class Protocol>
+        std::unique_ptr<server_base> create_stream_server(const typename Protocol::endpoint& ep, const handoff::state* taken) {
+#ifndef _WIN32
+            if (taken) {
+                return std::make_unique<stream_server<Protocol>>(io_context, ep, *taken, make_io_config());
+            }
+#endif
+            if (opts.shards > 1 || opts.coroutines) {
+                bool reuse_port{ false };
+#ifdef SO_REUSEPORT
+                reuse_port = std::is_same<Protocol, tcp>::value;
+#endif
+                uint32_t count = std::max<uint32_t>(opts.shards, 1);
+                std::vector<shard_placement> places(count);
+                for (uint32_t i = 0; i < count; ++i) {
+                    if (opts.busy_poll) {
+                        places[i].cpu = take_cpu();
+                    }
+                    if (opts.numa) {
+                        const auto& topo = numa::topology::instance();
+                        if (places[i].cpu < 0) {
+                            places[i].cpu = static_cast<int>(topo.cpu_for_worker(i));
+                        }
+                        places[i].node = topo.node_of(static_cast<uint32_t>(places[i].cpu));
+                    }
+                }
+                return std::make_unique<sharded_server<Protocol>>(ep, count, reuse_port, opts.coroutines, make_io_config(false), places);
+            }
+            if (opts.numa) {
+                log_write->warn("server manager: numa placement works on shards, run with --shards");
+            }
+            return std::make_unique<stream_server<Protocol>>(io_context, ep, make_io_config());
+        }
+
+#ifndef _WIN32
+        //runs when a successor connects: passes the listener, connections and storage, then shuts down,
+        //a successor that does not answer or take the state leaves this process serving as before
+        void hand_over(int sock) {
+            auto start = steady_clock::now();
+            if (!handoff::offer(sock)) {
+                log_write->error("srv_mgr::hand_over the successor did not answer, serving on");
+                ::close(sock);
+                successor_listener->listen_again();
+                return;
+            }
+            handoff::state st;
+            if (server) {
+                st.listen_fd = server->release_listener();
+            }
+            if (st.listen_fd < 0) {
+                log_write->error("srv_mgr::hand_over the running backend can't hand over its listener");
+                ::close(sock);
+                return;
+            }
+            if (exporter) {
+                st.metrics_fd = ::dup(exporter->native_handle());       //the successor serves /metrics without a bind
+            }
+            server->io().export_state(st);
+            bool ok = handoff::send_state(sock, st);
+            ::close(sock);
+            if (ok) {
+                server->io().state_handed_over();
+                handed_over.store(true);
+            }
+            else {
+                log_write->error("srv_mgr::hand_over the successor did not take the state, serving on");
+                server->resume_state(st);
+            }
+            ::close(st.listen_fd);
+            if (st.metrics_fd >= 0) {
+                ::close(st.metrics_fd);
+            }
+            for (auto& entry : st.connections) {
+                ::close(entry.fd);
+            }
+            log_write->info("srv_mgr::hand_over {} {} connections in {} ms", ok ? "handed over" : "failed to hand over",
+                st.connections.size(), duration_cast<milliseconds>(steady_clock::now() - start).count());
+            if (!ok) {
+                successor_listener->listen_again();
+                return;
+            }
+            std::raise(SIGTERM);            //the usual staged stop, nothing is left to drain
+        }
+#endif
+
+        //busy poll settings of a server thread, with_cpu takes the next of the configured cores for it
+        io_config make_io_config(bool with_cpu = true) {
+            io_config cfg;
+            cfg.busy_poll = opts.busy_poll;
+            cfg.busy_poll_us = opts.busy_poll_us;
+            cfg.cpu = opts.busy_poll && with_cpu ? take_cpu() : -1;
+            cfg.retain_closed = opts.retain_closed;
+            cfg.storage_budget = opts.storage_budget_mb << 20;
+            cfg.approx_threshold = opts.approx_threshold;
+            cfg.window = opts.window;
+            cfg.order_stats = opts.order_stats;
+            cfg.histograms = opts.histograms;
+            cfg.histogram_layout = opts.histogram_layout;
+            return cfg;
+        }
+
+        int take_cpu() {
+            if (next_cpu < opts.cpus.size()) {
+                return static_cast<int>(opts.cpus[next_cpu++]);
+            }
+            if (opts.busy_poll) {
+                log_write->warn("server manager: no isolated core left for a busy polling thread, it shares cores with everything else");
+            }
+            return -1;
+        }
+
+        void thread_func(int cpu) {
+            bool busy = opts.busy_poll && server && server->on_manager_context();
+            log_write->info("start server manager thread function{}", busy ? ", busy polling" : "");
             try{
-                srv::tcp_server server(io_context, port);
-                io_context.run();
+                wdg::loop_monitor io_monitor("io_context", wdg::LAG_PROBE_MS);
+                io_monitor.attach();
+                auto work = boost::asio::make_work_guard(io_context);
+                wdg::lag_probe probe(io_context, io_monitor);
+                if (busy) {
+                    if (cpu >= 0) {
+                        aff::pin_current_thread(cpu);
+                    }
+                    while (!io_context.stopped()) {
+                        io_context.poll();
+                    }
+                }
+                else {
+                    io_context.run();
+                }
             }
             catch (std::exception& e)
             {
@@ -226,8 +1573,17 @@ namespace srv {
         }
     private:
         boost::asio::io_context io_context;
-        uint16_t port{ DEFAULT_PORT };
+        options opts;
+        std::unique_ptr<mtr::http_exporter> exporter;
+        std::unique_ptr<server_base> server;
+#ifndef _WIN32
+        std::unique_ptr<handoff::listener> successor_listener;
+#endif
+        std::thread thr_handoff{};
+        std::atomic_bool handed_over{ false };
+        int taken_metrics_fd{ -1 };             //metrics listener of a predecessor, adopted by the exporter
         std::thread thr_mgr{};
+        size_t next_cpu{ 0 };
     };
 }
 #define SERVER srv::srv_mgr::instance()
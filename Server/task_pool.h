@@ -0,0 +1,201 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "logger.h"
+
+namespace tsk {
+
+    constexpr size_t NO_WORKER = static_cast<size_t>(-1);
+
+    //work stealing pool: every worker owns a deque, takes its newest task from the back,
+    //and when it runs dry steals the oldest task from the front of a random victim
+    class pool final {
+        struct worker {
+            std::mutex mtx;
+            std::deque<std::function<void()>> tasks;
+        };
+    public:
+        explicit pool(size_t count = std::max(1u, std::thread::hardware_concurrency())) {
+            for (size_t i = 0; i < count; ++i) {
+                workers.push_back(std::make_unique<worker>());
+            }
+            for (size_t i = 0; i < count; ++i) {
+                threads.emplace_back(std::bind(&pool::thr_func, this, i));
+            }
+            log_write->info("tsk::pool started {} workers", count);
+        }
+
+        ~pool() {
+            {
+                std::unique_lock<std::mutex> lock(sleep_mtx);
+                active = false;
+            }
+            sleep_cv.notify_all();
+            for (auto& thr : threads) {
+                thr.join();
+            }
+        }
+
+        pool(const pool&) = delete;
+        pool(pool&&) = delete;
+        pool& operator=(const pool&) = delete;
+        pool& operator= (pool&&) = delete;
+
+        static pool& instance() {
+            static pool p;
+            return p;
+        }
+
+        //a worker pushes onto its own deque, other threads spread tasks round robin
+        void submit(std::function<void()> task) {
+            size_t index = current();
+            if (index == NO_WORKER) {
+                index = next.fetch_add(1, std::memory_order_relaxed) % workers.size();
+            }
+            pending.fetch_add(1, std::memory_order_release);      //counted first so it never drops below zero
+            {
+                std::lock_guard<std::mutex> lock(workers[index]->mtx);
+                workers[index]->tasks.push_back(std::move(task));
+            }
+            {
+                std::lock_guard<std::mutex> lock(sleep_mtx);
+            }
+            sleep_cv.notify_one();
+        }
+
+        //runs one queued task on the calling thread, lets waiters help instead of blocking
+        bool run_one() {
+            std::function<void()> task;
+            size_t index = current();
+            if ((index != NO_WORKER && pop_local(index, task)) || steal(index, task)) {
+                pending.fetch_sub(1, std::memory_order_relaxed);
+                execute(task);
+                return true;
+            }
+            return false;
+        }
+
+        size_t size() const {
+            return workers.size();
+        }
+
+    private:
+        static size_t& current() {
+            thread_local size_t index = NO_WORKER;
+            return index;
+        }
+
+        void thr_func(size_t index) {
+            current() = index;
+            for (;;) {
+                if (run_one()) {
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(sleep_mtx);
+                sleep_cv.wait(lock, [this] { return !active || pending.load(std::memory_order_acquire) != 0; });
+                if (!active && pending.load(std::memory_order_acquire) == 0) {
+                    break;
+                }
+            }
+        }
+
+        bool pop_local(size_t index, std::function<void()>& task) {
+            worker& w = *workers[index];
+            std::lock_guard<std::mutex> lock(w.mtx);
+            if (w.tasks.empty()) {
+                return false;
+            }
+            task = std::move(w.tasks.back());
+            w.tasks.pop_back();
+            return true;
+        }
+
+        bool steal(size_t thief, std::function<void()>& task) {
+            thread_local std::minstd_rand rng(std::random_device{}());
+            size_t count = workers.size();
+            size_t start = rng() % count;
+            for (size_t i = 0; i < count; ++i) {
+                size_t victim = (start + i) % count;
+                if (victim == thief) {
+                    continue;
+                }
+                worker& w = *workers[victim];
+                std::lock_guard<std::mutex> lock(w.mtx);
+                if (!w.tasks.empty()) {
+                    task = std::move(w.tasks.front());
+                    w.tasks.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void execute(std::function<void()>& task) {
+            try {
+                task();
+            }
+            catch (std::exception& e) {
+                log_write->error("tsk::pool task failed: {}", e.what());
+            }
+        }
+
+    private:
+        std::vector<std::unique_ptr<worker>> workers;
+        std::vector<std::thread> threads;
+        std::atomic<size_t> pending{ 0 };
+        std::atomic<size_t> next{ 0 };
+        std::mutex sleep_mtx;
+        std::condition_variable sleep_cv;
+        bool active{ true };
+    };
+
+    //tasks of one batch, wait() helps the pool until all of them have finished
+    class group final {
+    public:
+        explicit group(pool& p_) : p(p_) {}
+        ~group() {
+            wait();
+        }
+        group(const group&) = delete;
+        group& operator=(const group&) = delete;
+
+        void run(std::function<void()> f) {
+            count.fetch_add(1, std::memory_order_relaxed);
+            p.submit([this, f] {
+                try {
+                    f();
+                }
+                catch (std::exception& e) {
+                    log_write->error("tsk::group task failed: {}", e.what());
+                }
+                std::lock_guard<std::mutex> lock(mtx);      //the waiter may free the group right after the last decrement
+                if (count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    cv.notify_all();
+                }
+            });
+        }
+
+        void wait() {
+            while (count.load(std::memory_order_acquire) != 0) {
+                if (!p.run_one()) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait_for(lock, std::chrono::milliseconds(1), [this] { return count.load(std::memory_order_acquire) == 0; });
+                }
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+        }
+    private:
+        pool& p;
+        std::atomic<size_t> count{ 0 };
+        std::mutex mtx;
+        std::condition_variable cv;
+    };
+}
+#define TASK_POOL tsk::pool::instance()
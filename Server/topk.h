@@ -0,0 +1,221 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "metrics.h"
+
+//heaviest connections without a scan: a space saving summary per client_io thread, snapshots of the
+//summaries are posted to a board that merges them for the metrics scrape
+namespace tpk {
+
+    constexpr uint32_t CAPACITY = 64;           //counters monitored per summary, the guaranteed heavy hitters are above n / CAPACITY
+    constexpr uint32_t REPORTED = 10;
+
+    struct entry {
+        uint32_t key;
+        uint64_t count;
+        uint64_t error;                         //count is at most this much above the true count
+    };
+
+    //space saving over a stream of keys: CAPACITY counters kept ordered by count, a new key takes the
+    //smallest counter over and inherits its count as the error, counters of equal count form a group,
+    //a counter that grows swaps to the front of its group and then past every group it now outcounts,
+    //one swap per group, so adding 1 is O(1) and adding any weight costs the groups it passes
+    class space_saving final {
+        struct group {
+            uint64_t count;
+            uint32_t first;                     //position of the group's first counter, counters are by count descending
+            uint32_t size;
+        };
+        struct counter {
+            uint32_t key;
+            uint64_t error;
+            uint32_t group;
+        };
+    public:
+        space_saving() {
+            counters.reserve(CAPACITY);
+            groups.reserve(CAPACITY);
+            positions.reserve(CAPACITY * 2);
+        }
+        space_saving(const space_saving&) = delete;
+        space_saving& operator=(const space_saving&) = delete;
+
+        //a key seen weight times in a row
+        void add(uint32_t key, uint64_t weight = 1) {
+            if (weight == 0) {
+                return;
+            }
+            auto it = positions.find(key);
+            if (it != positions.end()) {
+                raise(it->second, weight);
+                return;
+            }
+            if (counters.size() < CAPACITY) {
+                uint32_t pos = static_cast<uint32_t>(counters.size());
+                counters.push_back(counter{ key, 0, NONE });
+                positions.emplace(key, pos);
+                join_or_create(pos, 0);         //the smallest count there is, raised right away
+                raise(pos, weight);
+                return;
+            }
+            uint32_t last = CAPACITY - 1;       //the smallest count
+            positions.erase(counters[last].key);
+            counters[last].key = key;
+            counters[last].error = groups[counters[last].group].count;
+            positions.emplace(key, last);
+            raise(last, weight);
+        }
+
+        //the n largest counters, largest first
+        void top(uint32_t n, std::vector<entry>& out) const {
+            out.clear();
+            for (uint32_t pos = 0; pos < std::min<size_t>(n, counters.size()); ++pos) {
+                const counter& c = counters[pos];
+                out.push_back(entry{ c.key, groups[c.group].count, c.error });
+            }
+        }
+    private:
+        static constexpr uint32_t NONE = UINT32_MAX;
+
+        //the counter leaves its group from the front, every group in front of it with a smaller count than
+        //its new one gives its first counter the free slot at its back, so it shifts back by one and the
+        //counter takes its place, then the counter joins the group of its new count or opens it
+        void raise(uint32_t pos, uint64_t weight) {
+            uint32_t g = counters[pos].group;
+            uint64_t count = groups[g].count + weight;
+            uint32_t front = groups[g].first;
+            swap_positions(pos, front);
+            ++groups[g].first;
+            if (--groups[g].size == 0) {
+                free_groups.push_back(g);
+            }
+            while (front > 0) {
+                uint32_t prev = counters[front - 1].group;
+                if (groups[prev].count >= count) {
+                    break;
+                }
+                uint32_t prev_first = groups[prev].first;
+                swap_positions(front, prev_first);
+                ++groups[prev].first;
+                front = prev_first;
+            }
+            join_or_create(front, count);
+        }
+
+        //the counter at pos has count now, its neighbour in front may already have that count
+        void join_or_create(uint32_t pos, uint64_t count) {
+            if (pos > 0) {
+                uint32_t prev = counters[pos - 1].group;
+                if (groups[prev].count == count) {
+                    ++groups[prev].size;
+                    counters[pos].group = prev;
+                    return;
+                }
+            }
+            uint32_t g;
+            if (!free_groups.empty()) {
+                g = free_groups.back();
+                free_groups.pop_back();
+            }
+            else {
+                g = static_cast<uint32_t>(groups.size());
+                groups.push_back(group{});
+            }
+            groups[g] = group{ count, pos, 1 };
+            counters[pos].group = g;
+        }
+
+        void swap_positions(uint32_t a, uint32_t b) {
+            if (a == b) {
+                return;
+            }
+            std::swap(counters[a], counters[b]);
+            positions[counters[a].key] = a;
+            positions[counters[b].key] = b;
+        }
+
+        std::vector<counter> counters;
+        std::vector<group> groups;
+        std::vector<uint32_t> free_groups;
+        std::unordered_map<uint32_t, uint32_t> positions;
+    };
+
+    //latest snapshot of every summary, a connection number belongs to one thread so merging is a sort by count
+    class board final {
+        board() {
+            mtr::registry::instance().add_collector([this](std::ostream& os) { write(os); });
+        }
+    public:
+        board(const board&) = delete;
+        board(board&&) = delete;
+        board& operator=(const board&) = delete;
+        board& operator= (board&&) = delete;
+
+        static board& instance() {
+            static board b;
+            return b;
+        }
+
+        void post(const std::string& source, const std::string& metric, std::vector<entry> entries) {
+            const std::lock_guard<std::mutex> lock_mutex(mtx);
+            snapshots[metric][source] = std::move(entries);
+        }
+
+        std::vector<entry> merged(const std::string& metric) {
+            const std::lock_guard<std::mutex> lock_mutex(mtx);
+            std::vector<entry> all;
+            for (auto& source : snapshots[metric]) {
+                all.insert(all.end(), source.second.begin(), source.second.end());
+            }
+            std::sort(all.begin(), all.end(), [](const entry& a, const entry& b) { return a.count > b.count; });
+            if (all.size() > REPORTED) {
+                all.resize(REPORTED);
+            }
+            return all;
+        }
+
+        void write(std::ostream& os) {
+            std::vector<std::string> metrics;
+            {
+                const std::lock_guard<std::mutex> lock_mutex(mtx);
+                for (auto& m : snapshots) {
+                    metrics.push_back(m.first);
+                }
+            }
+            for (auto& metric : metrics) {
+                auto top = merged(metric);
+                os << "# HELP " << metric << " Heaviest connections, counts may be over by the _error metric\n";
+                os << "# TYPE " << metric << " gauge\n";
+                for (auto& e : top) {
+                    os << metric << "{connection=\"" << e.key << "\"} " << e.count << '\n';
+                }
+                os << "# TYPE " << metric << "_error gauge\n";
+                for (auto& e : top) {
+                    os << metric << "_error{connection=\"" << e.key << "\"} " << e.error << '\n';
+                }
+            }
+        }
+    private:
+        std::mutex mtx;
+        std::map<std::string, std::map<std::string, std::vector<entry>>> snapshots;
+    };
+
+    inline std::string to_string(const std::vector<entry>& entries) {
+        std::string out;
+        for (auto& e : entries) {
+            out += (out.empty() ? "" : " ") + std::to_string(e.key) + ":" + std::to_string(e.count);
+            if (e.error) {
+                out += "(err " + std::to_string(e.error) + ")";
+            }
+        }
+        return out;
+    }
+}
+
+#define HEAVY_HITTERS tpk::board::instance()
@@ -0,0 +1,199 @@
+#pragma once
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif
+#include "logger.h"
+#include "metrics.h"
+#include "SrvAlg.h"
+#include "waiter.h"
+
+namespace dgm {
+
+    using boost::asio::ip::udp;
+
+    //datagram: uint32 client id followed by uint32 numbers, a bare id asks for the current mean,
+    //which is answered with the id and the uint64 mean
+    constexpr uint32_t ID_SPACE = 0x80000000;          //storage numbers of udp clients, apart from stream connections
+    constexpr size_t MAX_DATAGRAM = 1472;
+    constexpr size_t RECV_BATCH = 64;
+    constexpr uint32_t RECV_TIMEOUT_MS = 100;
+    constexpr size_t MAX_QUEUED_BATCHES = 256;          //batches client_io has yet to take, further ones are dropped
+
+    struct datagram {
+        uint32_t number_connection;
+        uint32_t first;                 //index of the first number in batch::numbers
+        uint32_t count;                 //0 for a mean query
+        udp::endpoint from;
+    };
+
+    //everything one receive call brought in, consumed by client_io as a whole
+    struct batch {
+        std::vector<datagram> datagrams;
+        std::vector<uint32_t> numbers;
+    };
+
+    class ingest final {
+    public:
+        ingest(boost::asio::io_context& io_context, const udp::endpoint& ep)
+            : socket_(io_context, ep) {
+            log_write->info("dgm::ingest listening on {}:{}", ep.address().to_string(), ep.port());
+#ifdef __linux__
+            timeval tv{ 0, RECV_TIMEOUT_MS * 1000 };
+            setsockopt(socket_.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            thr_recv = std::thread(std::bind(&ingest::thr_func, this));
+#else
+            start_receive();
+#endif
+        }
+
+        ~ingest() {
+            active.store(false);
+            if (thr_recv.joinable()) {
+                thr_recv.join();
+            }
+            boost::system::error_code ec;
+            socket_.close(ec);
+        }
+
+        bool pop(batch& b) {
+            return q.pop(b);
+        }
+
+        size_t pending() const {
+            return q.size();
+        }
+
+        //every queued batch wakes the consumer
+        void set_waiter(wt::waiter* w) {
+            ready_waiter.store(w, std::memory_order_release);
+        }
+
+        //runs on the consumer thread, a lost reply is only logged, the client asks again
+        void reply(const datagram& d, uint64_t mean) {
+            uint8_t out[sizeof(uint32_t) + sizeof(uint64_t)];
+            uint32_t id = d.number_connection & ~ID_SPACE;
+            memcpy(out, &id, sizeof(id));
+            memcpy(out + sizeof(id), &mean, sizeof(mean));
+            boost::system::error_code ec;
+            socket_.send_to(boost::asio::buffer(out), d.from, 0, ec);
+            if (ec) {
+                log_write->warn("dgm::ingest reply to client {} error:{} message:{}", id, ec.value(), ec.message());
+            }
+        }
+
+    private:
+        //parses one datagram into b, malformed ones are counted and dropped
+        void parse(const uint8_t* data, size_t sz, const udp::endpoint& from, batch& b) {
+            if (sz < sizeof(uint32_t) || sz % sizeof(uint32_t) != 0) {
+                METRICS.udp_dropped.inc();
+                return;
+            }
+            uint32_t id{};
+            memcpy(&id, data, sizeof(id));
+            uint32_t count = static_cast<uint32_t>(sz / sizeof(uint32_t) - 1);
+            b.datagrams.push_back(datagram{ id | ID_SPACE, static_cast<uint32_t>(b.numbers.size()), count, from });
+            size_t first = b.numbers.size();
+            b.numbers.resize(first + count);
+            memcpy(b.numbers.data() + first, data + sizeof(id), count * sizeof(uint32_t));
+            METRICS.udp_datagrams.inc();
+            METRICS.bytes_in.inc(sz);
+        }
+
+        void push(batch& b) {
+            if (q.size() >= MAX_QUEUED_BATCHES) {
+                METRICS.udp_dropped.inc(b.datagrams.size());
+                return;
+            }
+            q.push(b);
+            if (wt::waiter* w = ready_waiter.load(std::memory_order_acquire)) {
+                w->notify();
+            }
+        }
+
+#ifdef __linux__
+        //one recvmmsg call fills up to RECV_BATCH datagrams, blocking for the first one only
+        void thr_func() {
+            log_write->info("dgm::ingest::thr_func start");
+            std::vector<uint8_t> buffers(RECV_BATCH * MAX_DATAGRAM);
+            std::vector<mmsghdr> msgs(RECV_BATCH);
+            std::vector<iovec> iovs(RECV_BATCH);
+            std::vector<sockaddr_storage> addrs(RECV_BATCH);
+            while (active.load()) {
+                for (size_t i = 0; i < RECV_BATCH; ++i) {
+                    iovs[i] = iovec{ buffers.data() + i * MAX_DATAGRAM, MAX_DATAGRAM };
+                    memset(&msgs[i], 0, sizeof(mmsghdr));
+                    msgs[i].msg_hdr.msg_iov = &iovs[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                    msgs[i].msg_hdr.msg_name = &addrs[i];
+                    msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+                }
+                int n = recvmmsg(socket_.native_handle(), msgs.data(), RECV_BATCH, MSG_WAITFORONE, nullptr);
+                if (n <= 0) {
+                    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                        log_write->error("dgm::ingest recvmmsg error:{} message:{}", errno, strerror(errno));
+                        break;
+                    }
+                    continue;
+                }
+                batch b;
+                b.datagrams.reserve(n);
+                for (int i = 0; i < n; ++i) {
+                    udp::endpoint from;
+                    memcpy(from.data(), &addrs[i], std::min<size_t>(msgs[i].msg_hdr.msg_namelen, from.capacity()));
+                    from.resize(msgs[i].msg_hdr.msg_namelen);
+                    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                        METRICS.udp_dropped.inc();          //longer than MAX_DATAGRAM, its tail is lost
+                        continue;
+                    }
+                    parse(buffers.data() + i * MAX_DATAGRAM, msgs[i].msg_len, from, b);
+                }
+                if (!b.datagrams.empty()) {
+                    push(b);
+                }
+            }
+            log_write->info("dgm::ingest::thr_func end");
+        }
+#else
+        void start_receive() {
+            socket_.async_receive_from(boost::asio::buffer(rd_buff), from_,
+                boost::bind(&ingest::handle_receive, this,
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred));
+        }
+
+        void handle_receive(const boost::system::error_code& error, size_t bytes_transferred) {
+            if (error == boost::asio::error::operation_aborted) {
+                return;
+            }
+            if (!error) {
+                batch b;
+                parse(rd_buff, bytes_transferred, from_, b);
+                if (!b.datagrams.empty()) {
+                    push(b);
+                }
+            }
+            else if (error == boost::asio::error::message_size) {
+                METRICS.udp_dropped.inc();                  //longer than MAX_DATAGRAM, its tail is lost
+            }
+            start_receive();
+        }
+
+        uint8_t rd_buff[MAX_DATAGRAM]{};
+        udp::endpoint from_;
+#endif
+
+    private:
+        udp::socket socket_;
+        salg::parallel_queue<batch> q;
+        std::thread thr_recv{};
+        std::atomic_bool active{ true };
+        std::atomic<wt::waiter*> ready_waiter{ nullptr };
+    };
+}
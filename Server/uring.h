@@ -0,0 +1,673 @@
+#pragma once
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "logger.h"
+#include "connect.h"
+#include "metrics.h"
+#include "waiter.h"
+#include "watchdog.h"
+
+namespace uring {
+
+    using namespace con;
+
+    constexpr unsigned RING_ENTRIES = 1024;
+    constexpr unsigned BUF_COUNT = 512;
+    constexpr unsigned BUF_SIZE = 2048;
+    constexpr uint16_t BUF_GROUP = 0;
+
+    enum OP_TYPE : uint8_t {
+        OP_ACCEPT = 1,
+        OP_RECV = 2,
+        OP_SEND = 3,
+        OP_CANCEL = 4
+    };
+
+    inline uint64_t make_user_data(OP_TYPE op, uint64_t id) {
+        return (uint64_t(op) << 56) | id;
+    }
+
+    //accept errors the next accept may not hit again, any other one means the listener is unusable
+    inline bool transient_accept_error(int err) {
+        switch (err) {
+        case EAGAIN:
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    //raw io_uring instance, owned and driven by a single thread
+    class ring final {
+    public:
+        explicit ring(unsigned entries) {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            if (fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+            }
+            sq_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_sz = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) {
+                sq_sz = cq_sz = std::max(sq_sz, cq_sz);
+            }
+            sq_ptr = map(sq_sz, IORING_OFF_SQ_RING);
+            cq_ptr = single_mmap ? sq_ptr : map(cq_sz, IORING_OFF_CQ_RING);
+            sqes_sz = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = static_cast<io_uring_sqe*>(map(sqes_sz, IORING_OFF_SQES));
+
+            uint8_t* sq = static_cast<uint8_t*>(sq_ptr);
+            sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+            sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+            sq_entries = params.sq_entries;
+            sq_local_tail = *sq_tail;
+
+            uint8_t* cq = static_cast<uint8_t*>(cq_ptr);
+            cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        }
+
+        ~ring() {
+            munmap(sqes, sqes_sz);
+            if (cq_ptr != sq_ptr) {
+                munmap(cq_ptr, cq_sz);
+            }
+            munmap(sq_ptr, sq_sz);
+            close(fd);
+        }
+
+        ring(const ring&) = delete;
+        ring& operator=(const ring&) = delete;
+
+        //returns a zeroed sqe, flushes the queue to the kernel when it is full
+        io_uring_sqe* get_sqe() {
+            if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                submit();
+                if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                    return nullptr;
+                }
+            }
+            unsigned idx = sq_local_tail & sq_mask;
+            io_uring_sqe* sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sq_array[idx] = idx;
+            ++sq_local_tail;
+            return sqe;
+        }
+
+        //one syscall for everything queued since the previous call
+        int submit(unsigned wait_nr = 0) {
+            __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+            unsigned to_submit = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if (to_submit == 0 && wait_nr == 0) {
+                return 0;
+            }
+            int ret = static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+            if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                log_write->error("uring::ring::submit io_uring_enter error:{} message:{}", errno, strerror(errno));
+            }
+            return ret;
+        }
+
+        template<class F>
+        unsigned reap(F&& on_cqe) {
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            unsigned n{ 0 };
+            for (; head != tail; ++head, ++n) {
+                on_cqe(cqes[head & cq_mask]);
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            return n;
+        }
+
+        int register_op(unsigned opcode, void* arg, unsigned nr_args) {
+            return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+        }
+
+    private:
+        void* map(size_t sz, off_t offset) {
+            void* ptr = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+            if (ptr == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "io_uring mmap");
+            }
+            return ptr;
+        }
+
+    private:
+        int fd{ -1 };
+        void* sq_ptr{};
+        void* cq_ptr{};
+        size_t sq_sz{};
+        size_t cq_sz{};
+        size_t sqes_sz{};
+        io_uring_sqe* sqes{};
+        unsigned* sq_head{};
+        unsigned* sq_tail{};
+        unsigned* sq_array{};
+        unsigned sq_mask{};
+        unsigned sq_entries{};
+        unsigned sq_local_tail{};
+        unsigned* cq_head{};
+        unsigned* cq_tail{};
+        unsigned cq_mask{};
+        io_uring_cqe* cqes{};
+    };
+
+    //buffers handed to the kernel for multishot recv, freed ones are given back in contiguous runs
+    class buf_pool final {
+    public:
+        buf_pool(ring& r, uint16_t group_, unsigned count_, unsigned size_)
+            : rng(r), group(group_), count(count_), size(size_) {
+            data = std::make_unique<uint8_t[]>(size_t(count) * size);
+            for (unsigned bid = 0; bid < count; ++bid) {
+                recycle(static_cast<uint16_t>(bid));
+            }
+            publish();
+            if (rng.submit(1) < 0) {
+                throw std::system_error(errno, std::generic_category(), "IORING_OP_PROVIDE_BUFFERS");
+            }
+            int res{ 0 };
+            rng.reap([&res](const io_uring_cqe& cqe) { res = std::min(res, cqe.res); });
+            if (res < 0) {
+                throw std::system_error(-res, std::generic_category(), "IORING_OP_PROVIDE_BUFFERS");
+            }
+        }
+
+        buf_pool(const buf_pool&) = delete;
+        buf_pool& operator=(const buf_pool&) = delete;
+
+        const uint8_t* buffer(uint16_t bid) const {
+            return data.get() + size_t(bid) * size;
+        }
+
+        void recycle(uint16_t bid) {
+            freed.push_back(bid);
+        }
+
+        //one sqe per run of consecutive buffer ids, submitted with the rest of the batch
+        void publish() {
+            if (freed.empty()) {
+                return;
+            }
+            std::sort(freed.begin(), freed.end());
+            size_t first = 0;
+            for (size_t i = 1; i <= freed.size(); ++i) {
+                if (i < freed.size() && freed[i] == freed[i - 1] + 1) {
+                    continue;
+                }
+                io_uring_sqe* sqe = rng.get_sqe();
+                if (sqe == nullptr) {
+                    freed.erase(freed.begin(), freed.begin() + first);
+                    return;
+                }
+                sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+                sqe->fd = static_cast<int>(i - first);
+                sqe->addr = reinterpret_cast<uint64_t>(buffer(freed[first]));
+                sqe->len = size;
+                sqe->off = freed[first];
+                sqe->buf_group = group;
+                sqe->user_data = 0;
+                first = i;
+            }
+            freed.clear();
+        }
+
+        uint16_t group_id() const {
+            return group;
+        }
+
+    private:
+        ring& rng;
+        uint16_t group{};
+        unsigned count{};
+        unsigned size{};
+        std::unique_ptr<uint8_t[]> data;
+        std::vector<uint16_t> freed;
+    };
+
+    class engine;
+
+    //same polling contract as tcp_connection, data arrives through multishot recv
+    class uring_connection final : public connection {
+    public:
+        using pointer = boost::shared_ptr<uring_connection>;
+
+        uring_connection(engine& eng_, uint64_t id_, int fd_, size_t sz_read_buff)
+            : eng(eng_), id(id_), fd(fd_), rd_buff_sz(sz_read_buff) {
+            rd_buff = std::make_unique<uint8_t[]>(sz_read_buff);
+        }
+
+        ~uring_connection() {
+            close(fd);
+        }
+
+        void read() override {
+            is_current_read_end.store(RW_STATUS::IN_PROGRESS);
+            memset(rd_buff.get(), 0, rd_buff_sz);
+            read_data_sz = 0;
+            complete_read();
+        }
+
+        void write(uint8_t* data, size_t sz) override;
+
+        RW_STATUS is_read() override {
+            return is_current_read_end.load();
+        }
+
+        RW_STATUS is_write() override {
+            return is_current_write_end.load();
+        }
+
+        bool is_open() override {
+            return !peer_closed;
+        }
+
+        size_t data_size() override {
+            return read_data_sz;
+        }
+
+        uint8_t* get_data() override {
+            return rd_buff.get();
+        }
+
+        void preload(const uint8_t* data, size_t sz) override {
+            pending.insert(pending.begin() + pending_off, data, data + sz);
+        }
+
+        int native_handle() const {
+            return fd;
+        }
+
+        uint64_t connection_id() const {
+            return id;
+        }
+
+        void on_recv(const uint8_t* data, size_t sz) {
+            pending.insert(pending.end(), data, data + sz);
+            complete_read();
+        }
+
+        void on_recv_end() {
+            peer_closed = true;
+            complete_read();
+        }
+
+        bool retired() const {
+            return peer_closed && !send_inflight;
+        }
+
+        void on_send(int res) {
+            send_inflight = false;
+            if (res < 0) {
+                is_current_write_end.store(RW_STATUS::CONNECTION_CLOSE);
+                return;
+            }
+            METRICS.bytes_out.inc(res);
+            wr_off += res;
+            if (wr_off < wr_sz) {
+                submit_send();
+                return;
+            }
+            is_current_write_end.store(RW_STATUS::COMPLETE);
+        }
+
+    private:
+        void complete_read() {
+            if (is_current_read_end.load() != RW_STATUS::IN_PROGRESS) {
+                return;
+            }
+            if (pending.size() - pending_off >= rd_buff_sz) {
+                memcpy(rd_buff.get(), pending.data() + pending_off, rd_buff_sz);
+                pending_off += rd_buff_sz;
+                if (pending_off == pending.size()) {
+                    pending.clear();
+                    pending_off = 0;
+                }
+                read_data_sz = rd_buff_sz;
+                is_current_read_end.store(RW_STATUS::COMPLETE);
+            }
+            else if (peer_closed) {
+                is_current_read_end.store(RW_STATUS::CONNECTION_CLOSE);
+            }
+        }
+
+        void submit_send() {
+            send_inflight = true;
+            eng_send();
+        }
+
+        void eng_send();
+
+    private:
+        engine& eng;
+        uint64_t id{};
+        int fd{ -1 };
+        std::unique_ptr<uint8_t[]> rd_buff{};
+        size_t rd_buff_sz{};
+        size_t read_data_sz{};
+        std::vector<uint8_t> pending;
+        size_t pending_off{ 0 };
+        uint8_t wr_buff[16]{};
+        size_t wr_sz{};
+        size_t wr_off{};
+        bool peer_closed{ false };
+        bool send_inflight{ false };
+        std::atomic<RW_STATUS> is_current_read_end{ RW_STATUS::UNKNOWN };
+        std::atomic<RW_STATUS> is_current_write_end{ RW_STATUS::UNKNOWN };
+    };
+
+    //listening socket with multishot accept, all connections share one ring and one buffer group,
+    //the ring signals an eventfd on every completion and a notifier thread blocked on it wakes the waiter
+    //of the thread polling the engine, so an idle engine costs no polling
+    class engine final {
+    public:
+        engine(const boost::asio::ip::tcp::endpoint& ep, size_t sz_read_buff_, std::function<void(connection::pointer)> on_accept_)
+            : rng(RING_ENTRIES), bufs(rng, BUF_GROUP, BUF_COUNT, BUF_SIZE), sz_read_buff(sz_read_buff_), on_accept(std::move(on_accept_)) {
+            event_fd = eventfd(0, EFD_CLOEXEC);
+            if (event_fd < 0) {
+                throw std::system_error(errno, std::generic_category(), "eventfd");
+            }
+            if (rng.register_op(IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+                int err = errno;
+                close(event_fd);
+                throw std::system_error(err, std::generic_category(), "IORING_REGISTER_EVENTFD");
+            }
+            listen_fd = socket(ep.protocol().family(), SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listen_fd < 0) {
+                int err = errno;
+                close(event_fd);
+                throw std::system_error(err, std::generic_category(), "socket");
+            }
+            int on = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(listen_fd, ep.data(), static_cast<socklen_t>(ep.size())) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+                int err = errno;
+                close(listen_fd);
+                close(event_fd);
+                throw std::system_error(err, std::generic_category(), "bind/listen");
+            }
+            //kernels before 5.19 reject multishot accept when it is submitted, the caller falls back to another backend
+            int err = probe_accept();
+            if (err) {
+                close(listen_fd);
+                close(event_fd);
+                throw std::system_error(err, std::generic_category(), "multishot accept");
+            }
+            notifier = std::thread(std::bind(&engine::notify_func, this));
+            log_write->info("uring::engine listen {}:{} ring entries:{} buffers:{}x{}", ep.address().to_string(), ep.port(), RING_ENTRIES, BUF_COUNT, BUF_SIZE);
+        }
+
+        //the polling thread must be done with the engine
+        ~engine() {
+            closing.store(true);
+            uint64_t one{ 1 };
+            if (write(event_fd, &one, sizeof(one)) < 0) {
+                log_write->error("uring::engine eventfd write error:{}", errno);
+            }
+            notifier.join();
+            close(event_fd);
+            if (listen_fd >= 0) {
+                close(listen_fd);
+            }
+        }
+
+        engine(const engine&) = delete;
+        engine& operator=(const engine&) = delete;
+
+        //w is notified after completions arrive, nullptr before w goes away
+        void set_waiter(wt::waiter* w) {
+            ready_waiter.store(w, std::memory_order_release);
+        }
+
+        //submits queued operations and dispatches completions, must run on a single thread
+        void poll() {
+            wdg::scope guard("uring::engine::poll");
+            for (auto& cqe : early) {
+                dispatch(cqe);
+            }
+            early.clear();
+            rng.submit();
+            rng.reap([this](const io_uring_cqe& cqe) { dispatch(cqe); });
+            if (accept_stop.load() && listen_fd >= 0) {
+                cancel_accept();
+            }
+            else if (!accept_armed && !accept_failed && listen_fd >= 0) {
+                arm_accept();
+            }
+            bufs.publish();
+            rng.submit();
+        }
+
+        void send(uring_connection& conn, const uint8_t* data, size_t sz) {
+            io_uring_sqe* sqe = rng.get_sqe();
+            if (sqe == nullptr) {
+                conn.on_send(-EBUSY);
+                return;
+            }
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn.native_handle();
+            sqe->addr = reinterpret_cast<uint64_t>(data);
+            sqe->len = static_cast<uint32_t>(sz);
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = make_user_data(OP_SEND, conn.connection_id());
+        }
+
+        //may be called from any thread, the cancel is issued by the next poll
+        void stop_accept() {
+            accept_stop.store(true);
+            wake();
+        }
+
+    private:
+        //arms the accept once in the constructor, an error the kernel reports right at submission is returned,
+        //completions that came meanwhile wait for the first poll
+        int probe_accept() {
+            arm_accept();
+            rng.submit();
+            int failed{ 0 };
+            rng.reap([this, &failed](const io_uring_cqe& cqe) {
+                if (static_cast<OP_TYPE>(cqe.user_data >> 56) == OP_ACCEPT && cqe.res < 0 && !transient_accept_error(-cqe.res)) {
+                    failed = -cqe.res;
+                }
+                else {
+                    early.push_back(cqe);
+                }
+            });
+            return failed;
+        }
+
+        void notify_func() {
+            uint64_t count{};
+            while (!closing.load()) {
+                if (read(event_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+                    log_write->error("uring::engine eventfd read error:{} message:{}", errno, strerror(errno));
+                    return;
+                }
+                wake();
+            }
+        }
+
+        void wake() {
+            wt::waiter* w = ready_waiter.load(std::memory_order_acquire);
+            if (w) {
+                w->notify();
+            }
+        }
+
+        void cancel_accept() {
+            if (accept_armed) {
+                io_uring_sqe* sqe = rng.get_sqe();
+                if (sqe == nullptr) {
+                    return;
+                }
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = make_user_data(OP_ACCEPT, 0);
+                sqe->user_data = make_user_data(OP_CANCEL, 0);
+            }
+            close(listen_fd);
+            listen_fd = -1;
+            log_write->info("uring::engine stop accept");
+        }
+
+        void arm_accept() {
+            io_uring_sqe* sqe = rng.get_sqe();
+            if (sqe == nullptr) {
+                return;
+            }
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listen_fd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            sqe->user_data = make_user_data(OP_ACCEPT, 0);
+            accept_armed = true;
+        }
+
+        void arm_recv(uring_connection& conn) {
+            io_uring_sqe* sqe = rng.get_sqe();
+            if (sqe == nullptr) {
+                conn.on_recv_end();
+                return;
+            }
+            sqe->opcode = IORING_OP_RECV;
+            sqe->fd = conn.native_handle();
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = bufs.group_id();
+            sqe->user_data = make_user_data(OP_RECV, conn.connection_id());
+        }
+
+        void dispatch(const io_uring_cqe& cqe) {
+            if (cqe.user_data == 0) {
+                if (cqe.res < 0) {
+                    log_write->error("uring::engine provide buffers error:{} message:{}", -cqe.res, strerror(-cqe.res));
+                }
+                return;
+            }
+            OP_TYPE op = static_cast<OP_TYPE>(cqe.user_data >> 56);
+            uint64_t id = cqe.user_data & ((uint64_t(1) << 56) - 1);
+            bool more = cqe.flags & IORING_CQE_F_MORE;
+            switch (op) {
+            case OP_ACCEPT:
+                if (!more) {
+                    accept_armed = false;
+                }
+                if (cqe.res >= 0) {
+                    auto conn = boost::shared_ptr<uring_connection>(new uring_connection(*this, next_id++, cqe.res, sz_read_buff));
+                    live[conn->connection_id()] = conn;
+                    arm_recv(*conn);
+                    log_write->info("uring::engine accept new connection fd:{}", cqe.res);
+                    on_accept(conn);
+                }
+                else if (cqe.res != -ECANCELED) {
+                    log_write->error("uring::engine accept error:{} message:{}", -cqe.res, strerror(-cqe.res));
+                    if (!transient_accept_error(-cqe.res)) {
+                        accept_failed = true;           //re-arming would fail the same way on every poll
+                        log_write->error("uring::engine accept disabled, no new connections are taken");
+                    }
+                }
+                break;
+            case OP_CANCEL:
+                break;
+            case OP_RECV: {
+                if (cqe.flags & IORING_CQE_F_BUFFER) {
+                    uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                    auto it = live.find(id);
+                    if (it != live.end() && cqe.res > 0) {
+                        METRICS.bytes_in.inc(cqe.res);
+                        it->second->on_recv(bufs.buffer(bid), cqe.res);
+                    }
+                    bufs.recycle(bid);
+                }
+                if (more) {
+                    break;
+                }
+                auto it = live.find(id);
+                if (it == live.end()) {
+                    break;
+                }
+                if (cqe.res > 0 || cqe.res == -ENOBUFS) {
+                    bufs.publish();
+                    arm_recv(*it->second);
+                }
+                else {
+                    log_write->info("uring::engine recv end connection:{} res:{}", id, cqe.res);
+                    it->second->on_recv_end();
+                    if (it->second->retired()) {
+                        live.erase(it);
+                    }
+                }
+                break;
+            }
+            case OP_SEND: {
+                auto it = live.find(id);
+                if (it != live.end()) {
+                    it->second->on_send(cqe.res);
+                    if (it->second->retired()) {
+                        live.erase(it);
+                    }
+                }
+                break;
+            }
+            }
+        }
+
+    private:
+        ring rng;
+        buf_pool bufs;
+        int listen_fd{ -1 };
+        int event_fd{ -1 };
+        bool accept_armed{ false };
+        bool accept_failed{ false };
+        std::atomic_bool accept_stop{ false };
+        std::atomic_bool closing{ false };
+        std::atomic<wt::waiter*> ready_waiter{ nullptr };
+        std::thread notifier;
+        std::vector<io_uring_cqe> early;
+        size_t sz_read_buff{};
+        uint64_t next_id{ 1 };
+        std::unordered_map<uint64_t, uring_connection::pointer> live;
+        std::function<void(connection::pointer)> on_accept;
+    };
+
+    inline void uring_connection::write(uint8_t* data, size_t sz) {
+        is_current_write_end.store(RW_STATUS::IN_PROGRESS);
+        wr_sz = std::min(sz, sizeof(wr_buff));
+        wr_off = 0;
+        memcpy(wr_buff, data, wr_sz);
+        submit_send();
+    }
+
+    inline void uring_connection::eng_send() {
+        eng.send(*this, wr_buff + wr_off, wr_sz - wr_off);
+    }
+}
+#endif
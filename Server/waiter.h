@@ -0,0 +1,145 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#ifdef __linux__
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace wt {
+
+    constexpr uint64_t MIN_SPIN_NS = 1000;
+    constexpr uint64_t MAX_SPIN_NS = 50000;
+    constexpr uint32_t SPINS_PER_CHECK = 64;
+    constexpr uint32_t EWMA_SHIFT = 3;              //every wait moves the average by 1/8 of its difference
+
+    inline void cpu_relax() {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+        _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    //one thread waits, any thread notifies: the wait spins, then yields, then parks on a futex
+    //(a condition variable off Linux), a notify that comes while nobody waits makes the next wait return at once,
+    //the spin window follows the average time waits took, so only short gaps between events are spun through
+    class waiter final {
+    public:
+        waiter() = default;
+        waiter(const waiter&) = delete;
+        waiter& operator=(const waiter&) = delete;
+
+        void notify() noexcept {
+            epoch.fetch_add(1);
+            if (parked.load()) {
+                wake();
+            }
+        }
+
+        //true when notified or ready() held, false when the timeout expired
+        template<class Ready>
+        bool wait_for(std::chrono::microseconds timeout, Ready&& ready) {
+            using clock = std::chrono::steady_clock;
+            auto start = clock::now();
+            auto elapsed = [&start] {
+                return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count());
+            };
+            uint64_t timeout_ns = static_cast<uint64_t>(timeout.count()) * 1000;
+            uint64_t spin_ns = std::min(spin_budget_ns, timeout_ns);
+            auto arrived = [this, &ready] {
+                return epoch.load(std::memory_order_acquire) != seen || ready();
+            };
+            while (elapsed() < spin_ns) {
+                for (uint32_t i = 0; i < SPINS_PER_CHECK; ++i) {
+                    if (arrived()) {
+                        return finish(true, elapsed());
+                    }
+                    cpu_relax();
+                }
+            }
+            while (elapsed() < std::min(spin_ns * 2, timeout_ns)) {
+                if (arrived()) {
+                    return finish(true, elapsed());
+                }
+                std::this_thread::yield();
+            }
+            for (;;) {
+                uint32_t e = epoch.load(std::memory_order_acquire);
+                if (e != seen || ready()) {
+                    return finish(true, elapsed());
+                }
+                uint64_t waited = elapsed();
+                if (waited >= timeout_ns) {
+                    return finish(false, waited);
+                }
+                parked.store(true);
+                if (epoch.load() == e) {
+                    park(e, timeout_ns - waited);
+                }
+                parked.store(false);
+            }
+        }
+
+        bool wait_for(std::chrono::microseconds timeout) {
+            return wait_for(timeout, [] { return false; });
+        }
+
+        uint64_t spin_budget() const {
+            return spin_budget_ns;
+        }
+    private:
+        bool finish(bool arrived, uint64_t waited_ns) {
+            seen = epoch.load(std::memory_order_acquire);
+            average_ns = average_ns + (static_cast<int64_t>(waited_ns) - average_ns) / (1 << EWMA_SHIFT);
+            uint64_t average = static_cast<uint64_t>(std::max<int64_t>(average_ns, 0));
+            spin_budget_ns = average <= MAX_SPIN_NS ? std::max(MIN_SPIN_NS, std::min(average * 2, MAX_SPIN_NS)) : MIN_SPIN_NS;
+            return arrived;
+        }
+
+#ifdef __linux__
+        void park(uint32_t e, uint64_t ns) {
+            timespec ts{ static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000) };
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAIT_PRIVATE, e, &ts, nullptr, 0);
+        }
+
+        void wake() {
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+        }
+#else
+        void park(uint32_t e, uint64_t ns) {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait_for(lock, std::chrono::nanoseconds(ns), [this, e] { return epoch.load() != e; });
+        }
+
+        void wake() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+            }
+            cv.notify_all();
+        }
+
+        std::mutex mtx;
+        std::condition_variable cv;
+#endif
+    private:
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "the futex word must be a plain 32 bit integer");
+        std::atomic<uint32_t> epoch{ 0 };
+        std::atomic_bool parked{ false };
+        uint32_t seen{ 0 };                         //epoch the last wait returned at, owned by the waiting thread
+        int64_t average_ns{ 0 };
+        uint64_t spin_budget_ns{ MIN_SPIN_NS };
+    };
+}
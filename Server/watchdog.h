@@ -0,0 +1,257 @@
+#pragma once
+#include <atomic>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/bind/bind.hpp>
+#include "logger.h"
+#include "metrics.h"
+
+namespace wdg {
+
+    constexpr uint32_t STALL_THRESHOLD_MS = 100;
+    constexpr uint32_t CHECK_PERIOD_MS = 20;
+    constexpr uint32_t LAG_PROBE_MS = 100;
+    constexpr size_t MAX_TAGS = 8;
+
+    inline uint64_t now_us() {
+        using namespace std::chrono;
+        return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+
+    //state of one event loop, written by the loop thread, read by the watchdog thread
+    class loop_monitor final {
+    public:
+        loop_monitor(const std::string& name_, uint32_t beat_period_ms_);
+        ~loop_monitor();
+        loop_monitor(const loop_monitor&) = delete;
+        loop_monitor& operator=(const loop_monitor&) = delete;
+
+        //binds the monitor to the calling thread, scopes opened on this thread report to it
+        void attach() {
+            current() = this;
+        }
+
+        static loop_monitor*& current() {
+            thread_local loop_monitor* mon = nullptr;
+            return mon;
+        }
+
+        void push(const char* tag) {
+            if (depth == 0) {
+                busy_since.store(now_us(), std::memory_order_relaxed);
+            }
+            if (depth < MAX_TAGS) {
+                tags[depth].store(tag, std::memory_order_relaxed);
+            }
+            depth_pub.store(static_cast<uint32_t>(std::min(++depth, MAX_TAGS)), std::memory_order_release);
+        }
+
+        void pop() {
+            depth_pub.store(static_cast<uint32_t>(std::min(--depth, MAX_TAGS)), std::memory_order_release);
+            if (depth == 0) {
+                uint64_t start = busy_since.exchange(0, std::memory_order_relaxed);
+                uint64_t took = now_us() - start;
+                handler_us.observe(took);
+                if (stalled.exchange(false, std::memory_order_relaxed)) {
+                    log_write->warn("watchdog: loop {} stall ended after {} ms", name, took / 1000);
+                }
+            }
+        }
+
+        //lag is how late the loop came back compared to when it expected to
+        void beat(uint64_t lag) {
+            lag_us.observe(lag);
+            last_beat.store(now_us(), std::memory_order_relaxed);
+        }
+
+        void check(uint64_t now, uint64_t threshold) {
+            uint64_t since = busy_since.load(std::memory_order_relaxed);
+            if (since != 0 && now > since + threshold && since != warned_since) {
+                warned_since = since;
+                stalled.store(true, std::memory_order_relaxed);
+                log_write->warn("watchdog: loop {} stalled {} ms in [{}]", name, (now - since) / 1000, tag_path());
+                return;
+            }
+            uint64_t beat_at = last_beat.load(std::memory_order_relaxed);
+            if (beat_at != 0 && now > beat_at + threshold + beat_period_ms * 1000 && beat_at != warned_beat) {
+                warned_beat = beat_at;
+                log_write->warn("watchdog: loop {} missed heartbeat for {} ms in [{}]", name, (now - beat_at) / 1000, tag_path());
+            }
+        }
+
+    private:
+        std::string tag_path() const {
+            uint32_t n = depth_pub.load(std::memory_order_acquire);
+            if (n == 0) {
+                return "untracked";
+            }
+            std::string path;
+            for (uint32_t i = 0; i < n; ++i) {
+                const char* tag = tags[i].load(std::memory_order_relaxed);
+                if (i) {
+                    path += " > ";
+                }
+                path += tag ? tag : "?";
+            }
+            return path;
+        }
+
+    private:
+        std::string name;
+        uint32_t beat_period_ms{};
+        size_t depth{ 0 };
+        std::atomic<uint32_t> depth_pub{ 0 };
+        std::array<std::atomic<const char*>, MAX_TAGS> tags{};
+        std::atomic<uint64_t> busy_since{ 0 };
+        std::atomic<uint64_t> last_beat{ 0 };
+        std::atomic_bool stalled{ false };
+        uint64_t warned_since{ 0 };
+        uint64_t warned_beat{ 0 };
+        mtr::histogram handler_us;
+        mtr::histogram lag_us;
+    };
+
+    //marks the enclosed code as running on the current thread's loop, no-op on unmonitored threads
+    class scope final {
+    public:
+        explicit scope(const char* tag) : mon(loop_monitor::current()) {
+            if (mon) {
+                mon->push(tag);
+            }
+        }
+        ~scope() {
+            if (mon) {
+                mon->pop();
+            }
+        }
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+    private:
+        loop_monitor* mon;
+    };
+
+    class watchdog final {
+        watchdog() = default;
+    public:
+        watchdog(const watchdog&) = delete;
+        watchdog(watchdog&&) = delete;
+        watchdog& operator=(const watchdog&) = delete;
+        watchdog& operator= (watchdog&&) = delete;
+
+        static watchdog& instance() {
+            static watchdog wd;
+            return wd;
+        }
+
+        void start(uint32_t threshold_ms = STALL_THRESHOLD_MS) {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (active) {
+                return;
+            }
+            active = true;
+            threshold_us = uint64_t(threshold_ms) * 1000;
+            thr_wd = std::thread(std::bind(&watchdog::thr_func, this));
+        }
+
+        void stop() {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                if (!active) {
+                    return;
+                }
+                active = false;
+            }
+            cv.notify_one();
+            thr_wd.join();
+        }
+
+        void add(loop_monitor* mon) {
+            std::unique_lock<std::mutex> lock(mtx);
+            monitors.push_back(mon);
+        }
+
+        void remove(loop_monitor* mon) {
+            std::unique_lock<std::mutex> lock(mtx);
+            monitors.erase(std::remove(monitors.begin(), monitors.end(), mon), monitors.end());
+        }
+
+    private:
+        void thr_func() {
+            log_write->info("watchdog::thr_func start, stall threshold {} ms", threshold_us / 1000);
+            std::unique_lock<std::mutex> lock(mtx);
+            while (!cv.wait_for(lock, std::chrono::milliseconds(CHECK_PERIOD_MS), [this] { return !active; })) {
+                uint64_t now = now_us();
+                for (auto mon : monitors) {
+                    mon->check(now, threshold_us);
+                }
+            }
+            log_write->info("watchdog::thr_func end");
+        }
+
+    private:
+        std::thread thr_wd{};
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::vector<loop_monitor*> monitors;
+        uint64_t threshold_us{ uint64_t(STALL_THRESHOLD_MS) * 1000 };
+        bool active{ false };
+    };
+
+    inline loop_monitor::loop_monitor(const std::string& name_, uint32_t beat_period_ms_)
+        : name(name_), beat_period_ms(beat_period_ms_) {
+        //every loop is one member of the two families, a loop whose histograms can't be registered
+        //is still checked for stalls, its handles stay unregistered and observe nothing
+        const std::vector<uint64_t> bounds{ 50, 100, 250, 500, 1000, 2500, 5000, 10000, 50000, 100000, 500000, 1000000 };
+        try {
+            handler_us = mtr::registry::instance().make_histogram("srv_loop_handler_us", "Time spent in loop handlers in microseconds", bounds, "loop=\"" + name + "\"");
+            lag_us = mtr::registry::instance().make_histogram("srv_loop_lag_us", "Wake up lag of loops in microseconds", bounds, "loop=\"" + name + "\"");
+        }
+        catch (std::exception& e) {
+            log_write->error("watchdog: loop {} runs without latency histograms: {}", name, e.what());
+        }
+        watchdog::instance().add(this);
+    }
+
+    inline loop_monitor::~loop_monitor() {
+        watchdog::instance().remove(this);
+        if (current() == this) {
+            current() = nullptr;
+        }
+    }
+
+    //periodic timer on an io_context, its lateness is the loop lag
+    class lag_probe final {
+    public:
+        lag_probe(boost::asio::io_context& io_context, loop_monitor& mon_)
+            : timer(io_context), mon(mon_) {
+            schedule();
+        }
+    private:
+        void schedule() {
+            expected = now_us() + LAG_PROBE_MS * 1000;
+            timer.expires_after(std::chrono::milliseconds(LAG_PROBE_MS));
+            timer.async_wait(boost::bind(&lag_probe::handle_timer, this, boost::asio::placeholders::error));
+        }
+
+        void handle_timer(const boost::system::error_code& error) {
+            if (error) {
+                return;
+            }
+            uint64_t now = now_us();
+            mon.beat(now > expected ? now - expected : 0);
+            schedule();
+        }
+    private:
+        boost::asio::steady_timer timer;
+        loop_monitor& mon;
+        uint64_t expected{};
+    };
+}
+#define WATCHDOG wdg::watchdog::instance()
@@ -0,0 +1,174 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "agg.h"
+
+namespace wnd {
+
+    constexpr uint32_t DEFAULT_BUCKETS = 16;
+    constexpr size_t PRUNE_SLACK = 1024;            //stale keys tolerated before the last seen map is rebuilt
+
+    enum class unit : uint8_t {
+        NONE,
+        MILLISECONDS,
+        MESSAGES
+    };
+
+    struct config {
+        unit kind{ unit::NONE };
+        uint64_t span{ 0 };                         //milliseconds or messages a window covers
+        uint32_t buckets{ DEFAULT_BUCKETS };
+
+        explicit operator bool() const {
+            return kind != unit::NONE && span != 0;
+        }
+    };
+
+    //"30s", "250ms" or "1000msg", false for anything else
+    inline bool parse(const std::string& text, config& cfg) {
+        size_t digits{ 0 };
+        uint64_t span = std::stoull(text, &digits);
+        std::string suffix = text.substr(digits);
+        if (span == 0) {
+            return false;
+        }
+        if (suffix == "s") {
+            cfg.kind = unit::MILLISECONDS;
+            cfg.span = span * 1000;
+        }
+        else if (suffix == "ms") {
+            cfg.kind = unit::MILLISECONDS;
+            cfg.span = span;
+        }
+        else if (suffix == "msg") {
+            cfg.kind = unit::MESSAGES;
+            cfg.span = span;
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+    inline uint64_t now_ms() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    //sum and count of a connection's recent values over a ring of buckets, each span / buckets wide,
+    //a step of the clock expires the buckets it passes and takes their totals off, so adds and queries are O(1),
+    //the window covers span give or take one bucket,
+    //a distinct window counts a value once, in the bucket it was last seen in, the last seen map
+    //moves a repeat there and is rebuilt from the live keys when stale ones outnumber them
+    class sliding_window final {
+        struct bucket {
+            agg::u128 sum;
+            uint64_t n{ 0 };
+        };
+    public:
+        sliding_window(const config& cfg_, bool distinct_)
+            : cfg(cfg_), buckets(std::max<uint32_t>(cfg_.buckets, 1)), width(std::max<uint64_t>((cfg_.span + buckets - 1) / buckets, 1)),
+              distinct(distinct_), ring(new bucket[buckets]), keys_arena(new mem::arena()), last_seen(new mem::flat_map(*keys_arena)) {}
+        sliding_window(const sliding_window&) = delete;
+        sliding_window& operator=(const sliding_window&) = delete;
+
+        void add(uint64_t v, uint64_t now) {
+            advance(tick(now, true) / width);
+            if (distinct) {
+                bool inserted;
+                uint64_t& seen = last_seen->emplace(v, inserted);       //epoch + 1, 0 while never seen
+                if (!inserted && seen != 0 && in_window(seen - 1)) {
+                    if (seen - 1 == head) {
+                        return;
+                    }
+                    bucket& old = ring[(seen - 1) % buckets];
+                    old.sum.sub(v);
+                    --old.n;
+                    total.sub(v);
+                    --total_n;
+                }
+                seen = head + 1;
+            }
+            bucket& b = ring[head % buckets];
+            b.sum.add(v);
+            ++b.n;
+            total.add(v);
+            ++total_n;
+            if (distinct && last_seen->size() > 2 * total_n + PRUNE_SLACK) {
+                prune();
+            }
+        }
+
+        uint64_t mean(uint64_t now) {
+            advance(tick(now, false) / width);
+            return total_n ? total.divide(total_n) : 0;
+        }
+
+        uint64_t count(uint64_t now) {
+            advance(tick(now, false) / width);
+            return total_n;
+        }
+
+        size_t memory() const {
+            return sizeof(sliding_window) + buckets * sizeof(bucket) + keys_arena->reserved();
+        }
+    private:
+        //a message window's clock is the message count
+        uint64_t tick(uint64_t now, bool message) {
+            if (cfg.kind == unit::MESSAGES) {
+                return message ? messages++ : (messages ? messages - 1 : 0);
+            }
+            return now;
+        }
+
+        bool in_window(uint64_t epoch) const {
+            return epoch + buckets > head;
+        }
+
+        void advance(uint64_t epoch) {
+            if (epoch <= head) {
+                return;
+            }
+            if (epoch - head >= buckets) {
+                std::fill(ring.get(), ring.get() + buckets, bucket());
+                total = agg::u128();
+                total_n = 0;
+                head = epoch;
+                return;
+            }
+            while (head < epoch) {
+                bucket& b = ring[++head % buckets];
+                total.sub(b.sum);
+                total_n -= b.n;
+                b = bucket();
+            }
+        }
+
+        void prune() {
+            std::unique_ptr<mem::arena> fresh_arena(new mem::arena());
+            std::unique_ptr<mem::flat_map> fresh(new mem::flat_map(*fresh_arena));
+            last_seen->for_each([this, &fresh](uint64_t key, uint64_t seen) {
+                if (seen != 0 && in_window(seen - 1)) {
+                    bool inserted;
+                    fresh->emplace(key, inserted) = seen;
+                }
+            });
+            last_seen = std::move(fresh);
+            keys_arena = std::move(fresh_arena);
+        }
+
+        config cfg;
+        uint32_t buckets;
+        uint64_t width;
+        bool distinct;
+        std::unique_ptr<bucket[]> ring;
+        agg::u128 total;
+        uint64_t total_n{ 0 };
+        uint64_t head{ 0 };                         //epoch of the newest bucket
+        uint64_t messages{ 0 };
+        std::unique_ptr<mem::arena> keys_arena;     //declared before the map living in it
+        std::unique_ptr<mem::flat_map> last_seen;
+    };
+}